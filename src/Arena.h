@@ -0,0 +1,71 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+
+namespace dragoon {
+
+/** Hands out memory from large blocks that are all freed at once. Objects
+    allocated from an arena are never destroyed individually, so they must
+    not own anything outside of it. */
+class Arena {
+public:
+  Arena(size_t block_size = 64 * 1024):
+    block_size_(block_size), pos_(NULL), end_(NULL) {}
+
+  ~Arena() { Clear(); }
+
+  /** Allocate memory aligned for any type */
+  void* Alloc(size_t size) {
+    size = (size + ALIGN - 1) & ~(size_t)(ALIGN - 1);
+    if ((size_t)(end_ - pos_) < size) {
+
+      // Large allocations get a block of their own
+      if (size > block_size_ / 4) {
+        blocks_.push_back((char*)malloc(size));
+        return blocks_.back();
+      }
+      blocks_.push_back((char*)malloc(block_size_));
+      pos_ = blocks_.back();
+      end_ = pos_ + block_size_;
+    }
+    void* p = pos_;
+    pos_ += size;
+    return p;
+  }
+
+  /** Allocate an uninitialized array */
+  template <class T> T* Alloc(size_t count) {
+    return (T*)Alloc(count * sizeof (T));
+  }
+
+  /** Free all memory allocated from the arena */
+  void Clear() {
+    for (int i = 0; i < (int)blocks_.size(); ++i)
+      free(blocks_[i]);
+    blocks_.clear();
+    pos_ = end_ = NULL;
+  }
+
+private:
+  enum { ALIGN = 16 };
+
+  Arena(const Arena&);
+  void operator=(const Arena&);
+
+  std::vector<char*> blocks_;
+  size_t block_size_;
+  char* pos_;
+  char* end_;
+};
+
+} // namespace dragoon
@@ -0,0 +1,139 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#include "log.h"
+#include "math.h"
+#include "Atlas.h"
+
+namespace dragoon {
+
+std::vector<Atlas::Page> Atlas::pages$;
+var::Int Atlas::size$("texture.atlas_size", 1024,
+                      "Texture atlas page size, 0 disables the atlas");
+
+Texture* Atlas::Place(Surface& surface, Vec<2>& origin, const char* name) {
+  int size = math::NextPow2(size$);
+  if (size < 1 || !surface.Valid())
+    return NULL;
+
+  // Leave a blank pixel around each surface so filtering does not bleed
+  int width = surface->w + 2;
+  int height = surface->h + 2;
+  if (width > size || height > size)
+    return NULL;
+
+  // Find the page with the lowest fit
+  int best = -1, best_index = -1, best_x = 0, best_y = 0;
+  for (int i = 0; i < (int)pages$.size(); ++i) {
+    int x, y;
+    int index = Fit(pages$[i], width, height, x, y);
+    if (index >= 0 && (best < 0 || y < best_y)) {
+      best = i;
+      best_index = index;
+      best_x = x;
+      best_y = y;
+    }
+  }
+
+  // Start a new page
+  if (best < 0) {
+    Page page;
+    page.texture = new Texture(size, size);
+    page.texture->page_ = true;
+    char buf[32];
+    snprintf(buf, sizeof (buf), "atlas page %d", (int)pages$.size());
+    page.texture->name_ = buf;
+    Texture::textures$[page.texture->name_] = page.texture;
+    page.skyline.push_back(Segment(0, 0, size));
+    page.area = 0;
+    page.count = 0;
+    pages$.push_back(page);
+    best = pages$.size() - 1;
+    best_index = Fit(pages$[best], width, height, best_x, best_y);
+    ASSERT(best_index >= 0);
+    DEBUG("Allocated %dx%d atlas page %d", size, size, best);
+  }
+
+  // Copy the surface onto the page
+  Page& page = pages$[best];
+  Insert(page, best_index, best_x, best_y, width, height);
+  origin = Vec<2>(best_x + 1, best_y + 1);
+  surface.Blit(page.texture->surface(), 0, 0, surface->w, surface->h,
+               best_x + 1, best_y + 1);
+  page.area += width * height;
+  ++page.count;
+  DEBUG("Packed '%s' (%dx%d) into atlas page %d at %d, %d; "
+        "%d textures, %.0f%% used", name, surface->w, surface->h, best,
+        best_x + 1, best_y + 1, page.count, 100.f * page.area / size / size);
+  return page.texture;
+}
+
+int Atlas::Fit(const Page& page, int width, int height, int& best_x,
+               int& best_y) {
+  int size = page.texture->surface()->w;
+  int best = -1, best_width = 0;
+  for (int i = 0; i < (int)page.skyline.size(); ++i) {
+    int x = page.skyline[i].x;
+    if (x + width > size)
+      break;
+
+    // Rectangle rests on the highest segment it spans
+    int y = 0;
+    for (int j = i, left = width; left > 0; ++j) {
+      ASSERT(j < (int)page.skyline.size());
+      if (page.skyline[j].y > y)
+        y = page.skyline[j].y;
+      left -= page.skyline[j].width;
+    }
+    if (y + height > size)
+      continue;
+
+    // Prefer the lowest position, then the tightest segment
+    if (best < 0 || y < best_y ||
+        (y == best_y && page.skyline[i].width < best_width)) {
+      best = i;
+      best_x = x;
+      best_y = y;
+      best_width = page.skyline[i].width;
+    }
+  }
+  return best;
+}
+
+void Atlas::Insert(Page& page, int index, int x, int y, int width,
+                   int height) {
+  std::vector<Segment>& sky = page.skyline;
+  sky.insert(sky.begin() + index, Segment(x, y + height, width));
+
+  // Trim the segments now covered by the new one
+  for (int i = index + 1; i < (int)sky.size(); ++i) {
+    int overlap = x + width - sky[i].x;
+    if (overlap <= 0)
+      break;
+    if (overlap < sky[i].width) {
+      sky[i].x += overlap;
+      sky[i].width -= overlap;
+      break;
+    }
+    sky.erase(sky.begin() + i--);
+  }
+
+  // Merge neighboring segments of the same height
+  for (int i = 0; i + 1 < (int)sky.size();)
+    if (sky[i].y == sky[i + 1].y) {
+      sky[i].width += sky[i + 1].width;
+      sky.erase(sky.begin() + i + 1);
+    } else
+      ++i;
+}
+
+} // namespace dragoon
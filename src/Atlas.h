@@ -0,0 +1,65 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+#include "var.h"
+#include "Texture.h"
+
+namespace dragoon {
+
+/** Static class that packs texture surfaces into a few large shared pages
+    so that sprites using different images can be drawn without rebinding.
+    Pages are filled with a skyline bottom-left packer. */
+class Atlas {
+public:
+
+  /** Copy a surface onto an atlas page.
+   *  @param surface  Surface to pack
+   *  @param origin   Set to the position of the surface on the page
+   *  @param name     Name of the surface for the debug log
+   *  @return Page texture or \c NULL if the surface cannot be packed
+   */
+  static Texture* Place(Surface& surface, Vec<2>& origin, const char* name);
+
+private:
+  Atlas() {}
+
+  /** Skyline segment, the top edge of the packed area over a span */
+  struct Segment {
+    Segment(int x, int y, int width): x(x), y(y), width(width) {}
+
+    int x;
+    int y;
+    int width;
+  };
+
+  /** Atlas page */
+  struct Page {
+    Texture* texture;
+    std::vector<Segment> skyline;
+    int area;
+    int count;
+  };
+
+  /** Find the lowest position for a rectangle on a page.
+   *  @return Skyline segment index to place at or -1 if it does not fit
+   */
+  static int Fit(const Page&, int width, int height, int& x, int& y);
+
+  /** Raise the skyline over a newly placed rectangle */
+  static void Insert(Page&, int index, int x, int y, int width, int height);
+
+  static std::vector<Page> pages$;
+  static var::Int size$;
+};
+
+} // namespace dragoon
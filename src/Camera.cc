@@ -0,0 +1,93 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#include "log.h"
+#include "Camera.h"
+#include "Mode.h"
+#include "SpriteBatch.h"
+
+namespace dragoon {
+
+std::vector<Camera::Rect> Camera::clips$;
+Vec<2> Camera::origin$;
+float Camera::zoom$ = 1;
+bool Camera::active$;
+
+void Camera::Begin() {
+  ASSERT(!active$);
+  active$ = true;
+  Apply();
+}
+
+void Camera::End() {
+  ASSERT(active$);
+  active$ = false;
+  Apply();
+  glClear(GL_DEPTH_BUFFER_BIT);
+}
+
+Camera::Rect Camera::Clip() {
+  if (clips$.empty())
+    return Rect(Vec<2>(0, 0), Vec<2>(Mode::width(), Mode::height()));
+  return clips$.back();
+}
+
+void Camera::View(Vec<2>& origin, Vec<2>& size) {
+  Rect clip = Clip();
+  origin = clip.origin;
+  size = clip.size;
+  if (active$) {
+    origin = origin$ + origin / zoom$;
+    size /= zoom$;
+  }
+}
+
+void Camera::PushClip(Vec<2> origin, Vec<2> size) {
+  if (active$) {
+    origin = (origin - origin$) * zoom$;
+    size *= zoom$;
+  }
+
+  // Intersect with the current clip rectangle
+  Rect clip = Clip();
+  Vec<2> end = origin + size, clip_end = clip.origin + clip.size;
+  for (int i = 0; i < 2; ++i) {
+    origin[i] = std::max(origin[i], clip.origin.get(i));
+    end[i] = std::max(std::min(end[i], clip_end.get(i)), origin[i]);
+  }
+  clips$.push_back(Rect(origin, end - origin));
+  Apply();
+}
+
+void Camera::PopClip() {
+  if (clips$.empty()) {
+    WARN("Clip stack is empty");
+    return;
+  }
+  clips$.pop_back();
+  Apply();
+}
+
+void Camera::Apply() {
+  SpriteBatch::Flush();
+  Vec<2> screen(Mode::width(), Mode::height());
+  if (active$)
+    Mode::Projection(origin$, screen / zoom$);
+  else
+    Mode::Projection(Vec<2>(0, 0), screen);
+  if (clips$.empty())
+    Mode::Unclip();
+  else
+    Mode::Clip(clips$.back().origin, clips$.back().size);
+}
+
+} // namespace dragoon
@@ -0,0 +1,77 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+#include "Vec.h"
+
+namespace dragoon {
+
+/** Static class for the view of the level. Sprites drawn between Begin() and
+    End() are in world coordinates and are projected through the camera,
+    everything else is drawn in screen coordinates. Drawing can be limited
+    to a stack of clip rectangles. */
+class Camera {
+public:
+
+  /** World position shown at the top-left corner of the screen */
+  static Vec<2> origin() { return origin$; }
+  static void set_origin(Vec<2> origin) { origin$ = origin; }
+
+  /** Screen pixels per world unit */
+  static float zoom() { return zoom$; }
+  static void set_zoom(float zoom) { zoom$ = zoom; }
+
+  /** Returns true between Begin() and End() */
+  static bool active() { return active$; }
+
+  /** Start drawing in world coordinates */
+  static void Begin();
+
+  /** Go back to drawing in screen coordinates. Screen sprites are always
+      drawn over the world. */
+  static void End();
+
+  /** Get the visible rectangle in the current coordinates, which is the
+      screen or the innermost clip rectangle */
+  static void View(Vec<2>& origin, Vec<2>& size);
+
+  /** Limit drawing to the part of a rectangle in the current coordinates
+      that is inside the current clip rectangle */
+  static void PushClip(Vec<2> origin, Vec<2> size);
+
+  /** Restore the previous clip rectangle */
+  static void PopClip();
+
+private:
+  Camera() {}
+
+  /** Rectangle in scaled screen coordinates */
+  struct Rect {
+    Rect(Vec<2> origin, Vec<2> size): origin(origin), size(size) {}
+
+    Vec<2> origin;
+    Vec<2> size;
+  };
+
+  /** Returns the innermost clip rectangle or the whole screen */
+  static Rect Clip();
+
+  /** Flush the sprites drawn so far and set the projection and clipping */
+  static void Apply();
+
+  static std::vector<Rect> clips$;
+  static Vec<2> origin$;
+  static float zoom$;
+  static bool active$;
+};
+
+} // namespace dragoon
@@ -11,36 +11,111 @@
 \******************************************************************************/
 
 #include "log.h"
+#include "os.h"
+#include "str.h"
 #include "Config.h"
 
 namespace dragoon {
 
-Config::Node::~Node() {
-  delete child_;
-  delete next_;
+namespace {
+
+  const char COMPILED_MAGIC[4] = { 'D', 'C', 'F', 'G' };
+  const int COMPILED_VERSION = 1;
+
+  // Header of a compiled config, followed by the nodes, the token string
+  // offsets, the stamp and then the zero-terminated token strings
+  struct CompiledHeader {
+    char magic[4];
+    int version;
+    int stamp_length;
+    int nodes;
+    int tokens;
+    int strings;
+  };
+
+  // Compiled node, links are node indices or -1
+  struct CompiledNode {
+    int first_token;
+    int size;
+    int next;
+    int child;
+    int line;
+  };
+
+  // Compiled form of a parsed node tree, nodes are numbered depth first
+  struct Compiled {
+    std::vector<CompiledNode> nodes;
+    std::vector<int> tokens;
+    std::string strings;
+    std::map<std::string, int> offsets;
+
+    // Add a list of nodes and their children
+    // @returns Index of the first node or -1 if there are none
+    int Add(const Config::Node* node) {
+      int first = -1, prev = -1;
+      for (; node; node = node->next()) {
+        int index = nodes.size();
+        CompiledNode compiled = { (int)tokens.size(), node->size(), -1, -1,
+                                  node->line() };
+        nodes.push_back(compiled);
+        if (prev >= 0)
+          nodes[prev].next = index;
+        else
+          first = index;
+        prev = index;
+
+        // Identical tokens share a string
+        for (int i = 0; i < node->size(); ++i) {
+          std::string token = node->token(i);
+          std::map<std::string, int>::iterator it = offsets.find(token);
+          if (it == offsets.end()) {
+            it = offsets.insert(std::make_pair(token, strings.size())).first;
+            strings.append(token.c_str(), token.size() + 1);
+          }
+          tokens.push_back(it->second);
+        }
+        int child = Add(node->child());
+        nodes[index].child = child;
+      }
+      return first;
+    }
+  };
+
+  // Returns true if a character is always read as itself
+  bool Plain(char ch) {
+    return ch && ch != ' ' && ch != '\t' && ch != '\r' && ch != '\n' &&
+           ch != '\\' && ch != '#' && ch != '{' && ch != '}';
+  }
 }
 
-char Config::Node::Getch(FILE* f, int& line) {
+var::Bool Config::cache$("config.cache", true,
+                         "Cache compiled configuration files in the user "
+                         "directory");
+
+char Config::Node::Getch(Reader& r) {
   int ch;
 
   // Skip windows carriage returns
   do {
-    ch = fgetc(f);
+    ch = r.Next();
 
     // Slash-newline continuation
     if (ch == '\\') {
-      ch = fgetc(f);
-      if (ch == '\n') {
-        ++line;
+      ch = r.Next();
+      if (ch == '\n')
         continue;
-      }
     }
 
   } while (ch == '\r');
 
   // Skip comment lines
-  if (ch == '#')
-    while (ch != EOF && (ch = fgetc(f)) != '\n');
+  if (ch == '#') {
+    char* end = (char*)memchr(r.pos, '\n', r.end - r.pos);
+    r.pos = end ? end + 1 : r.end;
+    ch = end ? '\n' : EOF;
+    if (end)
+      ++r.line;
+  }
 
   // Convert tabs to spaces
   if (ch == '\t')
@@ -50,97 +125,313 @@ char Config::Node::Getch(FILE* f, int& line) {
   if (ch == EOF)
     return 0;
 
-  // Count newlines
-  if (ch == '\n')
-    ++line;
-
   return (char)ch;
 }
 
-int Config::Node::SkipSpace(FILE* f, int& line) {
+int Config::Node::SkipSpace(Reader& r) {
+  if (r.back == EOF)
+    while (r.pos < r.end && *r.pos == ' ')
+      ++r.pos;
   int ch;
-  for (ch = Getch(f, line); ch == ' '; ch = Getch(f, line));
+  for (ch = Getch(r); ch == ' '; ch = Getch(r));
   return ch;
 }
 
-void Config::Node::Token(FILE* f, std::string& out, int& line) {
-  out.clear();
-  char ch = SkipSpace(f, line);
+int Config::Node::Token(Reader& r, const char*& token) {
+  char ch = SkipSpace(r);
   if (!ch)
-    return;
+    return 0;
+
+  // Braces and newlines are never copied
+  if (ch == '{' || ch == '}' || ch == '\n') {
+    token = ch == '{' ? "{" : ch == '}' ? "}" : "\n";
+    return 1;
+  }
+
+  // Quotes and identifiers are written over the characters they were read
+  // from, which never lags behind reading
+  char* out = r.pos - 1;
+  token = out;
 
   // Read quote
   if (ch == '"')
-    for (ch = Getch(f, line); ch && ch != '"'; ch = Getch(f, line)) {
+    for (ch = Getch(r); ch && ch != '"'; ch = Getch(r)) {
       if (ch == '\\') {
-        ch = Getch(f, line);
+        ch = Getch(r);
         if (ch == 'n')
           ch = '\n';
       }
-      out.push_back(ch);
+      *out++ = ch;
     }
 
-  // Read brace
-  else if (ch == '{' || ch == '}' || ch == '\n')
-    out.push_back(ch);
-
-  // Read identifier
+  // Read identifier, runs of plain characters are copied at once
   else
-    for (; ch; ch = Getch(f, line)) {
+    for (; ch; ch = Getch(r)) {
       if (ch == ' ' || ch == '{' || ch == '}' || ch == '\n') {
-        ungetc(ch, f);
+        r.Unget(ch);
         break;
       }
-      out.push_back(ch);
+      *out++ = ch;
+      char* run = r.pos;
+      while (run < r.end && Plain(*run))
+        ++run;
+      if (out != r.pos)
+        memmove(out, r.pos, run - r.pos);
+      out += run - r.pos;
+      r.pos = run;
     }
+
+  *out = 0;
+  return out - token;
+}
+
+void Config::Node::Finish(Reader& r, int first) {
+  size_ = r.tokens.size() - first;
+  tokens_ = r.arena.Alloc<const char*>(size_);
+  for (int i = 0; i < size_; ++i)
+    tokens_[i] = r.tokens[first + i];
+  r.tokens.resize(first);
+  key_ = str::HashLower(token(0));
 }
 
-Config::Node* Config::Node::Parse(FILE* f, const char* filename) {
-  std::string t;
+Config::Node* Config::Node::Parse(Reader& r) {
+  const char* t;
+  int length;
+  int first = r.tokens.size();
   Node* cur = NULL;
   Node* prev = NULL;
   Node* root = NULL;
-  int line = 1;
-  for (Token(f, t, line); t.size(); Token(f, t, line)) {
-    if (t == "}")
+  for (length = Token(r, t); length; length = Token(r, t)) {
+    if (length == 1 && t[0] == '}')
       break;
-    if (t == "\n") {
+    if (length == 1 && t[0] == '\n') {
       if (cur) {
+        cur->Finish(r, first);
         prev = cur;
         cur = NULL;
       }
       continue;
     }
     if (!cur) {
-      cur = new Node();
-      cur->filename_ = filename;
-      cur->line_ = line;
+      cur = r.arena.Alloc<Node>(1);
+      cur->Init(r.arena, r.filename, r.line);
       if (prev)
         prev->next_ = cur;
       if (!root)
         root = cur;
     }
-    if (t == "{")
-      cur->child_ = Parse(f, filename);
-    else {
-      cur->tokens_.push_back(t);
-      if (cur->string_.size())
-        cur->string_ += " ";
-      cur->string_ += t;
-    }
+    if (length == 1 && t[0] == '{')
+      cur->child_ = Parse(r);
+    else
+      r.tokens.push_back(t);
   }
+  if (cur)
+    cur->Finish(r, first);
   return root;
 }
 
-Config::Config(const char* filename): filename_(filename) {
-  FILE* f = fopen(filename, "r");
-  if (!f)
+const char* Config::Node::c_str() const {
+  if (string_)
+    return string_;
+  if (size_ < 2)
+    return string_ = size_ ? tokens_[0] : "";
+  size_t length = size_;
+  for (int i = 0; i < size_; ++i)
+    length += strlen(tokens_[i]);
+  char* string = arena_->Alloc<char>(length);
+  string_ = string;
+  for (int i = 0; i < size_; ++i) {
+    size_t token_length = strlen(tokens_[i]);
+    memcpy(string, tokens_[i], token_length);
+    string += token_length;
+    *string++ = ' ';
+  }
+  string[-1] = 0;
+  return string_;
+}
+
+unsigned int Config::Node::Hash() const {
+
+  // Tokens keep their terminating zeros and blocks are bracketed so that
+  // differently split contents never hash the same
+  unsigned int hash = str::Hash("", 0);
+  for (int i = 0; i < size_; ++i)
+    hash = str::Hash(tokens_[i], strlen(tokens_[i]) + 1, hash);
+  if (child_) {
+    hash = str::Hash("{", 1, hash);
+    for (const Node* n = child_; n; n = n->next_) {
+      unsigned int child_hash = n->Hash();
+      hash = str::Hash(&child_hash, sizeof (child_hash), hash);
+    }
+    hash = str::Hash("}", 1, hash);
+  }
+  return hash;
+}
+
+Config::Keywords::Keywords(const char* const* names): names_(names) {
+  while (names[keys_.size()])
+    keys_.push_back(str::HashLower(names[keys_.size()]));
+
+  // Double the table until every keyword has a slot of its own. Keywords
+  // with the same hash can never be told apart, the first one is kept.
+  for (mask_ = 1; ; mask_ = mask_ * 2 + 1) {
+    slots_.assign(mask_ + 1, -1);
+    int i;
+    for (i = 0; i < (int)keys_.size(); ++i) {
+      int& slot = slots_[keys_[i] & mask_];
+      ASSERT(slot < 0 || keys_[slot] != keys_[i]);
+      if (slot < 0)
+        slot = i;
+      else if (keys_[slot] != keys_[i])
+        break;
+    }
+    if (i == (int)keys_.size())
+      break;
+  }
+}
+
+Config::Config(const char* filename):
+  root_(NULL), map_(NULL), map_size_(0), filename_(filename) {
+
+  // Use the compiled config if the file has not changed since
+  std::string cache_name, stamp;
+  long long file_size, mtime;
+  if (cache$ && os::CacheDir() &&
+      os::FileInfo(filename, file_size, mtime)) {
+    char buf[64];
+    snprintf(buf, sizeof (buf), " %lld %lld", file_size, mtime);
+    stamp = filename_ + buf;
+    snprintf(buf, sizeof (buf), "/%08x.cfb", str::Hash(filename));
+    cache_name = os::CacheDir();
+    cache_name += buf;
+    if (LoadCompiled(cache_name.c_str(), stamp)) {
+      DEBUG("Loaded configuration file '%s' from cache", filename);
+      return;
+    }
+  }
+
+  // Read the whole file into the arena, tokens are kept in place
+  FILE* f = fopen(filename, "rb");
+  if (!f) {
     WARN("Failed to open configuration file '%s'", filename);
-  else {
-    DEBUG("Parsing configuration file '%s'", filename);
-    root_ = Node::Parse(f, filename_.c_str());
-    fclose(f);
+    return;
+  }
+  fseek(f, 0, SEEK_END);
+  long size = ftell(f);
+  rewind(f);
+  if (size < 0)
+    size = 0;
+  char* buffer = arena_.Alloc<char>(size + 1);
+  size = fread(buffer, 1, size, f);
+  fclose(f);
+  DEBUG("Parsing configuration file '%s'", filename);
+  Node::Reader reader(buffer, size, arena_, filename_.c_str());
+  root_ = Node::Parse(reader);
+  if (!stamp.empty())
+    SaveCompiled(cache_name.c_str(), stamp);
+}
+
+Config::~Config() {
+  os::UnmapFile(map_, map_size_);
+}
+
+bool Config::LoadCompiled(const char* filename, const std::string& stamp) {
+  size_t size;
+  const char* data = (const char*)os::MapFile(filename, size);
+  if (!data)
+    return false;
+
+  // Check that the file is complete and was made from the same source
+  CompiledHeader header;
+  if (size < sizeof (header)) {
+    os::UnmapFile(data, size);
+    return false;
+  }
+  memcpy(&header, data, sizeof (header));
+  bool success =
+    !memcmp(header.magic, COMPILED_MAGIC, sizeof (header.magic)) &&
+    header.version == COMPILED_VERSION &&
+    header.stamp_length == (int)stamp.size() &&
+    header.nodes >= 0 && header.tokens >= 0 && header.strings >= 0 &&
+    size == sizeof (header) + header.nodes * sizeof (CompiledNode) +
+            header.tokens * sizeof (int) + stamp.size() + header.strings;
+  if (!success) {
+    os::UnmapFile(data, size);
+    return false;
+  }
+  const CompiledNode* nodes = (const CompiledNode*)(data + sizeof (header));
+  const int* tokens = (const int*)(nodes + header.nodes);
+  const char* strings = (const char*)(tokens + header.tokens) + stamp.size();
+  success = !memcmp(strings - stamp.size(), stamp.data(), stamp.size()) &&
+            (!header.strings || !strings[header.strings - 1]);
+
+  // Links only point forward and every index must be in range
+  for (int i = 0; success && i < header.nodes; ++i) {
+    const CompiledNode& n = nodes[i];
+    success = n.size >= 0 && n.first_token >= 0 &&
+              n.first_token + n.size <= header.tokens &&
+              (n.next < 0 || (n.next > i && n.next < header.nodes)) &&
+              (n.child < 0 || (n.child > i && n.child < header.nodes));
   }
+  for (int i = 0; success && i < header.tokens; ++i)
+    success = tokens[i] >= 0 && tokens[i] < header.strings;
+  if (!success) {
+    os::UnmapFile(data, size);
+    return false;
+  }
+
+  // Tokens point into the mapped strings
+  const char** token_ptrs = arena_.Alloc<const char*>(header.tokens);
+  for (int i = 0; i < header.tokens; ++i)
+    token_ptrs[i] = strings + tokens[i];
+  Node* linked = arena_.Alloc<Node>(header.nodes);
+  for (int i = 0; i < header.nodes; ++i) {
+    const CompiledNode& n = nodes[i];
+    linked[i].Init(arena_, filename_.c_str(), n.line);
+    linked[i].tokens_ = token_ptrs + n.first_token;
+    linked[i].size_ = n.size;
+    linked[i].next_ = n.next < 0 ? NULL : linked + n.next;
+    linked[i].child_ = n.child < 0 ? NULL : linked + n.child;
+    linked[i].key_ = str::HashLower(linked[i].token(0));
+  }
+  root_ = header.nodes ? linked : NULL;
+  map_ = data;
+  map_size_ = size;
+  return true;
+}
+
+void Config::SaveCompiled(const char* filename,
+                          const std::string& stamp) const {
+  Compiled compiled;
+  compiled.Add(root_);
+  CompiledHeader header;
+  memcpy(header.magic, COMPILED_MAGIC, sizeof (header.magic));
+  header.version = COMPILED_VERSION;
+  header.stamp_length = stamp.size();
+  header.nodes = compiled.nodes.size();
+  header.tokens = compiled.tokens.size();
+  header.strings = compiled.strings.size();
+
+  // Write to a temporary file first so a partial file is never loaded
+  std::string temp_name = std::string(filename) + ".tmp";
+  FILE* file = os::OpenWrite(temp_name.c_str());
+  if (!file)
+    return;
+  bool success =
+    fwrite(&header, sizeof (header), 1, file) == 1 &&
+    (!header.nodes ||
+     fwrite(&compiled.nodes[0], sizeof (CompiledNode), header.nodes, file) ==
+       compiled.nodes.size()) &&
+    (!header.tokens ||
+     fwrite(&compiled.tokens[0], sizeof (int), header.tokens, file) ==
+       compiled.tokens.size()) &&
+    fwrite(stamp.data(), 1, stamp.size(), file) == stamp.size() &&
+    fwrite(compiled.strings.data(), 1, header.strings, file) ==
+      compiled.strings.size();
+  success = !fclose(file) && success;
+  success = success && !rename(temp_name.c_str(), filename);
+  if (!success)
+    remove(temp_name.c_str());
 }
 
 } // namespace dragoon
@@ -11,28 +11,37 @@
 \******************************************************************************/
 
 #pragma once
-#include "ptr.h"
+#include "str.h"
+#include "var.h"
+#include "Arena.h"
 
 namespace dragoon {
 
-/** Configuration file reader */
+/** Configuration file reader. The file contents, nodes and tokens are all
+    kept in an arena owned by the config object and are freed with it.
+    Parsed files are compiled into a cache in the user directory that is
+    mapped straight into memory while the file stays unchanged. */
 class Config {
 public:
 
   /** Class representing a list of tokens and an optional block */
   class Node {
   public:
-    ~Node();
 
     /** Match a string token (case-insensitive) */
     bool Match(unsigned int i, const char* s) const {
-      if (i >= tokens_.size())
+      if (i >= (unsigned int)size_)
         return s == NULL;
-      return !strcasecmp(tokens_[i].c_str(), s);
+      return !strcasecmp(tokens_[i], s);
     }
 
     /** Match the entire string */
-    bool Match(const char* s) const { return !strcasecmp(string_.c_str(), s); }
+    bool Match(const char* s) const { return !strcasecmp(c_str(), s); }
+
+    /** Lowercase hash of a token, computed once for the first token */
+    unsigned int key(unsigned int i = 0) const {
+      return i ? str::HashLower(token(i)) : key_;
+    }
 
     /** Get filename */
     const char* filename() const { return filename_; };
@@ -47,43 +56,142 @@ public:
     const Node* child() const { return child_; }
 
     /** Length of tokens list */
-    int size() const { return tokens_.size(); }
+    int size() const { return size_; }
+
+    /** Return the entire string, joined from the tokens the first time */
+    const char* c_str() const;
 
-    /** Return the entire string */
-    const char* c_str() const { return string_.c_str(); }
+    /** Hash of the tokens of the node and everything in its block, but not
+        of its position in the file */
+    unsigned int Hash() const;
 
     /** Return a token as a string */
     const char* token(unsigned int i) const {
-      return i < tokens_.size() ? tokens_[i].c_str() : "";
+      return i < (unsigned int)size_ ? tokens_[i] : "";
     }
 
-    /** Build a node graph by reading from a file stream */
-    static Node* Parse(FILE* stream, const char* filename = NULL);
-
   private:
-    Node(): next_(NULL), child_(NULL) {}
+    friend class Config;
+
+    /** Initialize a node with no tokens, links or joined string */
+    void Init(Arena& arena, const char* filename, int line) {
+      tokens_ = NULL;
+      string_ = NULL;
+      arena_ = &arena;
+      next_ = child_ = NULL;
+      filename_ = filename;
+      size_ = 0;
+      line_ = line;
+      key_ = str::HashLower("");
+    }
+
+    /** Parser state. Tokens are unescaped in place in the file buffer, which
+        must have room for a terminating zero. Counts each newline read once,
+        even if it is put back and read again. */
+    struct Reader {
+      Reader(char* buffer, size_t size, Arena& arena, const char* filename):
+        pos(buffer), end(buffer + size), arena(arena), filename(filename),
+        line(1), back(EOF) {}
+
+      /** Read a character or a character that was put back */
+      int Next() {
+        int ch = back;
+        if (ch != EOF)
+          back = EOF;
+        else if (pos < end)
+          ch = (unsigned char)*pos++;
+        if (ch == '\n')
+          ++line;
+        return ch;
+      }
+
+      /** Put back a character so that it is read next */
+      void Unget(int ch) {
+        back = ch;
+        if (ch == '\n')
+          --line;
+      }
+
+      char* pos;
+      char* end;
+      Arena& arena;
+      const char* filename;
+      std::vector<const char*> tokens;
+      int line;
+      int back;
+    };
 
     // Some helper functions for parsing
-    static char Getch(FILE*, int& line);
-    static int SkipSpace(FILE*, int& line);
-    static void Token(FILE*, std::string&, int& line);
+    static Node* Parse(Reader&);
+    static char Getch(Reader&);
+    static int SkipSpace(Reader&);
+    static int Token(Reader&, const char*& token);
+
+    /** Move the tokens read for the node into the arena */
+    void Finish(Reader&, int first);
 
-    std::vector<std::string> tokens_;
-    std::string string_;
+    const char** tokens_;
+    mutable const char* string_;
+    Arena* arena_;
     Node* next_;
     Node* child_;
     const char* filename_;
+    int size_;
     int line_;
+    unsigned int key_;
   };
 
+  /** Case-insensitive keyword table. Keywords are found by the lowercase
+      hash of a token in a table sized so that no two of them share a slot,
+      which leaves a single string comparison per lookup. */
+  class Keywords {
+  public:
+
+    /** Build the table from a NULL-terminated list, keyword ids are their
+        indices in the list */
+    Keywords(const char* const* names);
+
+    /** Returns the id of a node token or -1 if it is not a keyword */
+    int Find(const Node* node, unsigned int i = 0) const {
+      if (i >= (unsigned int)node->size())
+        return -1;
+      unsigned int key = node->key(i);
+      int id = slots_[key & mask_];
+      return id >= 0 && keys_[id] == key &&
+             !strcasecmp(names_[id], node->token(i)) ? id : -1;
+    }
+
+  private:
+    const char* const* names_;
+    std::vector<unsigned int> keys_;
+    std::vector<int> slots_;
+    unsigned int mask_;
+  };
+
+  ~Config();
+
   /** Read in and parse configuration file */
   Config(const char* filename);
 
   /** Get the root node */
-  const Node* root() { return root_; }
+  const Node* root() const { return root_; }
 
 private:
-  ptr::Scope<Node> root_;
+
+  /** Map a compiled config and link its nodes
+   *  @returns true if the file was valid and had a matching stamp
+   */
+  bool LoadCompiled(const char* filename, const std::string& stamp);
+
+  /** Write the parsed nodes in compiled form */
+  void SaveCompiled(const char* filename, const std::string& stamp) const;
+
+  static var::Bool cache$;
+
+  Arena arena_;
+  const Node* root_;
+  const void* map_;
+  size_t map_size_;
   const std::string filename_;
 };
 
@@ -0,0 +1,123 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+#include "Vec.h"
+
+namespace dragoon {
+
+/** Uniform grid spatial index of rectangles. Items are listed in every cell
+    their rectangle overlaps and cells are only allocated where there are
+    items, so a query only looks at the items near the queried area. */
+template <class T> class Grid {
+public:
+
+  /** Range of cells an item is listed in, kept by the item */
+  struct Cells {
+    Cells(): x0(0), y0(0), x1(-1), y1(-1) {}
+
+    bool empty() const { return x1 < x0; }
+
+    bool operator==(const Cells& c) const {
+      return x0 == c.x0 && y0 == c.y0 && x1 == c.x1 && y1 == c.y1;
+    }
+
+    int x0;
+    int y0;
+    int x1;
+    int y1;
+  };
+
+  Grid(float cell_size): cell_size_(cell_size) {}
+
+  /** Cells that overlap a rectangle */
+  Cells Cover(Vec<2> origin, Vec<2> size) const {
+    Cells c;
+    c.x0 = (int)floorf(origin.x() / cell_size_);
+    c.y0 = (int)floorf(origin.y() / cell_size_);
+    c.x1 = (int)floorf((origin.x() + size.x()) / cell_size_);
+    c.y1 = (int)floorf((origin.y() + size.y()) / cell_size_);
+    return c;
+  }
+
+  /** List an item in the cells that overlap a rectangle. Nothing is done if
+      the item already covers the same cells. */
+  void Move(T* item, Cells& cells, Vec<2> origin, Vec<2> size) {
+    Cells moved = Cover(origin, size);
+    if (moved == cells)
+      return;
+    Remove(item, cells);
+    cells = moved;
+    for (int y = cells.y0; y <= cells.y1; ++y)
+      for (int x = cells.x0; x <= cells.x1; ++x)
+        cells_[Key(x, y)].push_back(Entry(item, &cells));
+  }
+
+  /** Remove an item from all of its cells */
+  void Remove(T* item, Cells& cells) {
+    for (int y = cells.y0; y <= cells.y1; ++y)
+      for (int x = cells.x0; x <= cells.x1; ++x) {
+        typename CellMap::iterator it = cells_.find(Key(x, y));
+        if (it == cells_.end())
+          continue;
+        std::vector<Entry>& entries = it->second;
+        for (int i = 0; i < (int)entries.size(); ++i)
+          if (entries[i].item == item) {
+            entries[i] = entries.back();
+            entries.pop_back();
+            break;
+          }
+        if (entries.empty())
+          cells_.erase(it);
+      }
+    cells = Cells();
+  }
+
+  /** Append the items whose cells overlap a rectangle to a list. Each item
+      is only reported by the first of its cells inside the queried range. */
+  void Query(Vec<2> origin, Vec<2> size, std::vector<T*>& items) const {
+    Cells q = Cover(origin, size);
+    for (int y = q.y0; y <= q.y1; ++y)
+      for (int x = q.x0; x <= q.x1; ++x) {
+        typename CellMap::const_iterator it = cells_.find(Key(x, y));
+        if (it == cells_.end())
+          continue;
+        const std::vector<Entry>& entries = it->second;
+        for (int i = 0; i < (int)entries.size(); ++i) {
+          const Cells& c = *entries[i].cells;
+          if (x == std::max(c.x0, q.x0) && y == std::max(c.y0, q.y0))
+            items.push_back(entries[i].item);
+        }
+      }
+  }
+
+private:
+  struct Entry {
+    Entry(T* item, const Cells* cells): item(item), cells(cells) {}
+
+    T* item;
+    const Cells* cells;
+  };
+
+  typedef std::map<unsigned long long, std::vector<Entry> > CellMap;
+
+  /** Cell coordinates are negative left of and above the world origin, so
+      they are packed as unsigned values */
+  static unsigned long long Key(int x, int y) {
+    return ((unsigned long long)(unsigned int)x << 32) | (unsigned int)y;
+  }
+
+  CellMap cells_;
+  float cell_size_;
+};
+
+} // namespace dragoon
@@ -0,0 +1,151 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#include "log.h"
+#include "os.h"
+#include "Jobs.h"
+
+namespace dragoon {
+
+std::deque<Jobs::Job*> Jobs::queued$;
+std::vector<Jobs::Job*> Jobs::done$;
+std::vector<SDL_Thread*> Jobs::workers$;
+SDL_mutex* Jobs::mutex$;
+SDL_cond* Jobs::queued_cond$;
+SDL_cond* Jobs::done_cond$;
+bool Jobs::quit$;
+var::Int Jobs::threads$("jobs.threads", 0,
+                        "Worker threads for loading, 0 uses one per core");
+
+void Jobs::Init() {
+  if (!workers$.empty())
+    return;
+  int count = threads$ > 0 ? (int)threads$ : os::Cores();
+  if (count < 2) {
+    DEBUG("Running jobs on the main thread");
+    return;
+  }
+  mutex$ = SDL_CreateMutex();
+  queued_cond$ = SDL_CreateCond();
+  done_cond$ = SDL_CreateCond();
+  quit$ = false;
+  for (int i = 0; i < count; ++i) {
+    SDL_Thread* thread = SDL_CreateThread(Work, NULL);
+    if (!thread) {
+      WARN("Failed to create worker thread: %s", SDL_GetError());
+      break;
+    }
+    workers$.push_back(thread);
+  }
+  DEBUG("Started %d worker threads", (int)workers$.size());
+}
+
+void Jobs::Cleanup() {
+  if (workers$.empty())
+    return;
+
+  // Workers drain the queue before exiting
+  SDL_mutexP(mutex$);
+  quit$ = true;
+  SDL_CondBroadcast(queued_cond$);
+  SDL_mutexV(mutex$);
+  for (int i = 0; i < (int)workers$.size(); ++i)
+    SDL_WaitThread(workers$[i], NULL);
+  workers$.clear();
+  Poll();
+
+  SDL_DestroyCond(done_cond$);
+  SDL_DestroyCond(queued_cond$);
+  SDL_DestroyMutex(mutex$);
+  mutex$ = NULL;
+  DEBUG("Stopped worker threads");
+}
+
+void Jobs::Add(Job* job) {
+  if (workers$.empty()) {
+    job->Run();
+    job->Finish();
+    delete job;
+    return;
+  }
+  SDL_mutexP(mutex$);
+  queued$.push_back(job);
+  SDL_CondSignal(queued_cond$);
+  SDL_mutexV(mutex$);
+}
+
+void Jobs::Poll() {
+  if (!mutex$)
+    return;
+
+  // Jobs are taken out one at a time so that a job waited on while another
+  // is being finished is still found, jobs completing meanwhile are left
+  // for the next poll
+  SDL_mutexP(mutex$);
+  int count = done$.size();
+  SDL_mutexV(mutex$);
+  for (int i = 0; i < count; ++i) {
+    SDL_mutexP(mutex$);
+    if (done$.empty()) {
+      SDL_mutexV(mutex$);
+      break;
+    }
+    Job* job = done$.front();
+    done$.erase(done$.begin());
+    SDL_mutexV(mutex$);
+    job->Finish();
+    delete job;
+  }
+}
+
+void Jobs::Wait(Job* job) {
+  if (!mutex$)
+    return;
+
+  // Only the awaited job is finished, other completed jobs wait for Poll()
+  SDL_mutexP(mutex$);
+  while (!job->done_)
+    SDL_CondWait(done_cond$, mutex$);
+  done$.erase(std::remove(done$.begin(), done$.end(), job), done$.end());
+  SDL_mutexV(mutex$);
+  job->Finish();
+  delete job;
+}
+
+int Jobs::Work(void*) {
+  SDL_mutexP(mutex$);
+  for (;;) {
+    while (queued$.empty() && !quit$)
+      SDL_CondWait(queued_cond$, mutex$);
+    if (queued$.empty())
+      break;
+    Job* job = queued$.front();
+    queued$.pop_front();
+    SDL_mutexV(mutex$);
+
+    // Errors in a job do not take down the worker
+    try {
+      job->Run();
+    } catch (log::Exception& e) {
+      e.Print(log::LEVEL_WARN);
+    }
+
+    SDL_mutexP(mutex$);
+    job->done_ = true;
+    done$.push_back(job);
+    SDL_CondBroadcast(done_cond$);
+  }
+  SDL_mutexV(mutex$);
+  return 0;
+}
+
+} // namespace dragoon
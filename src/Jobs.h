@@ -0,0 +1,78 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+#include "var.h"
+
+namespace dragoon {
+
+/** Static class that runs jobs on a pool of worker threads. Jobs do their
+    work off the main thread and are then finished on the main thread, where
+    they can touch OpenGL and other shared state. */
+class Jobs {
+public:
+
+  /** Base class for work that can be done on a worker thread */
+  class Job {
+  public:
+    Job(): done_(false) {}
+    virtual ~Job() {}
+
+    /** Do the work, called on a worker thread */
+    virtual void Run() = 0;
+
+    /** Called on the main thread after Run() has returned */
+    virtual void Finish() {}
+
+  private:
+    friend class Jobs;
+
+    bool done_;
+  };
+
+  /** Start the worker threads */
+  static void Init();
+
+  /** Run all queued jobs to completion and stop the worker threads */
+  static void Cleanup();
+
+  /** Queue a job. The job is deleted after it has been finished. Without
+      worker threads the job is run and finished immediately. */
+  static void Add(Job*);
+
+  /** Finish all jobs that have completed, call once per frame */
+  static void Poll();
+
+  /** Block until a job has completed and finish it. Other completed jobs
+      are left for Poll(). The job must not have been finished already. */
+  static void Wait(Job*);
+
+  /** Number of worker threads */
+  static int workers() { return workers$.size(); }
+
+private:
+  Jobs() {}
+
+  /** Worker thread main loop */
+  static int Work(void*);
+
+  static std::deque<Job*> queued$;
+  static std::vector<Job*> done$;
+  static std::vector<SDL_Thread*> workers$;
+  static SDL_mutex* mutex$;
+  static SDL_cond* queued_cond$;
+  static SDL_cond* done_cond$;
+  static bool quit$;
+  static var::Int threads$;
+};
+
+} // namespace dragoon
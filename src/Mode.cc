@@ -13,6 +13,7 @@
 #include "log.h"
 #include "var.h"
 #include "Timer.h"
+#include "SpriteBatch.h"
 #include "Texture.h"
 #include "Mode.h"
 
@@ -25,6 +26,20 @@ var::Int Mode::height$("mode.height", 768, "Screen/window resolution height");
 var::Bool Mode::clear$("mode.clear", true);
 var::Int Mode::target_height$("mode.target_height", -1);
 Count Mode::faces$;
+Count Mode::calls$;
+Count Mode::state_changes$;
+Count Mode::state_skips$;
+std::map<unsigned int, std::pair<GLint, GLint> > Mode::filters$;
+Vec<2> Mode::texture_translate$;
+Vec<2> Mode::texture_scale$;
+GLenum Mode::blend_src$;
+GLenum Mode::blend_dest$;
+GLenum Mode::alpha_func$;
+float Mode::alpha_ref$;
+GLenum Mode::matrix_mode$;
+unsigned int Mode::texture$;
+int Mode::caps$[CAPS];
+bool Mode::texture_matrix$;
 int Mode::init_frame$;
 int Mode::scale$;
 int Mode::width_scaled$;
@@ -38,6 +53,128 @@ void Mode::Check() {
 }
 #endif
 
+namespace {
+
+  // Value of cached state that is not known
+  const unsigned int UNKNOWN = (unsigned int)-1;
+}
+
+void Mode::Enable(GLenum cap, bool enable) {
+  int index;
+  switch (cap) {
+  case GL_BLEND:
+    index = CAP_BLEND;
+    break;
+  case GL_ALPHA_TEST:
+    index = CAP_ALPHA_TEST;
+    break;
+  case GL_DEPTH_TEST:
+    index = CAP_DEPTH_TEST;
+    break;
+  case GL_TEXTURE_2D:
+    index = CAP_TEXTURE_2D;
+    break;
+  default:
+    index = -1;
+  }
+  if (index >= 0 && !Change(caps$[index] != enable))
+    return;
+  if (enable)
+    glEnable(cap);
+  else
+    glDisable(cap);
+  if (index >= 0)
+    caps$[index] = enable;
+}
+
+void Mode::BlendFunc(GLenum src, GLenum dest) {
+  if (!Change(src != blend_src$ || dest != blend_dest$))
+    return;
+  glBlendFunc(src, dest);
+  blend_src$ = src;
+  blend_dest$ = dest;
+}
+
+void Mode::AlphaFunc(GLenum func, float ref) {
+  if (!Change(func != alpha_func$ || ref != alpha_ref$))
+    return;
+  glAlphaFunc(func, ref);
+  alpha_func$ = func;
+  alpha_ref$ = ref;
+}
+
+void Mode::BindTexture(unsigned int name) {
+  if (!Change(name != texture$))
+    return;
+  glBindTexture(GL_TEXTURE_2D, name);
+  texture$ = name;
+}
+
+void Mode::TextureFilters(GLint min, GLint mag) {
+  std::pair<GLint, GLint> filters(min, mag);
+  std::map<unsigned int, std::pair<GLint, GLint> >::iterator it =
+    filters$.find(texture$);
+  if (!Change(texture$ == UNKNOWN || it == filters$.end() ||
+              it->second != filters))
+    return;
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, min);
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, mag);
+  if (texture$ != UNKNOWN)
+    filters$[texture$] = filters;
+}
+
+void Mode::DeleteTexture(unsigned int& name) {
+  if (!name)
+    return;
+  glDeleteTextures(1, &name);
+  filters$.erase(name);
+  if (texture$ == name)
+    texture$ = 0;
+  name = 0;
+}
+
+void Mode::TextureMatrix(Vec<2> translate, Vec<2> scale) {
+  if (!Change(!texture_matrix$ || !(translate == texture_translate$) ||
+              !(scale == texture_scale$)))
+    return;
+  MatrixMode(GL_TEXTURE);
+  glLoadIdentity();
+  glTranslatef(translate.x(), translate.y(), 0.f);
+  glScalef(scale.x(), scale.y(), 1.f);
+  MatrixMode(GL_MODELVIEW);
+  texture_translate$ = translate;
+  texture_scale$ = scale;
+  texture_matrix$ = true;
+}
+
+void Mode::MultTextureMatrix(Vec<2> translate, Vec<2> scale) {
+  if (!texture_matrix$) {
+    MatrixMode(GL_TEXTURE);
+    glTranslatef(translate.x(), translate.y(), 0.f);
+    glScalef(scale.x(), scale.y(), 1.f);
+    MatrixMode(GL_MODELVIEW);
+    return;
+  }
+  TextureMatrix(texture_translate$ + texture_scale$ * translate,
+                texture_scale$ * scale);
+}
+
+void Mode::MatrixMode(GLenum mode) {
+  if (!Change(mode != matrix_mode$))
+    return;
+  glMatrixMode(mode);
+  matrix_mode$ = mode;
+}
+
+void Mode::ResetState() {
+  for (int i = 0; i < CAPS; ++i)
+    caps$[i] = -1;
+  blend_src$ = blend_dest$ = alpha_func$ = matrix_mode$ = UNKNOWN;
+  texture$ = UNKNOWN;
+  texture_matrix$ = false;
+  filters$.clear();
+}
+
 void Mode::Set(int width, int height, bool fullscreen) {
   int flags;
 
@@ -80,27 +217,28 @@ void Mode::Set(int width, int height, bool fullscreen) {
   // Update reset frame so we reinitialize textures as necessary
   init_frame$ = Timer::frame();
 
+  // The context may have been recreated
+  ResetState();
+
   // Screen viewport
   glViewport(0, 0, width$, height$);
 
-  // Orthogonal projection
-  glMatrixMode(GL_PROJECTION);
-  glLoadIdentity();
-  glOrtho(0.f, width_scaled$, height_scaled$, 0.f, 0.f, -1.f);
+  // Orthogonal projection of the scaled screen
+  Projection(Vec<2>(0, 0), Vec<2>(width_scaled$, height_scaled$));
 
   // Identity model matrix
-  glMatrixMode(GL_MODELVIEW);
+  MatrixMode(GL_MODELVIEW);
   glLoadIdentity();
 
   // Minimal alpha testing
-  glEnable(GL_ALPHA_TEST);
-  glAlphaFunc(GL_GREATER, 1 / 255.f);
+  Enable(GL_ALPHA_TEST);
+  AlphaFunc(GL_GREATER, 1 / 255.f);
 
   // Background clear color
   glClearColor(1.0f, 0.0f, 1.0f, 1.f);
 
   // No texture by default
-  glDisable(GL_TEXTURE_2D);
+  Disable(GL_TEXTURE_2D);
 
   // We use lines to do 2D edge anti-aliasing although there is probably
   // a better way so we need to always smooth lines (requires alpha
@@ -109,13 +247,35 @@ void Mode::Set(int width, int height, bool fullscreen) {
   glHint(GL_LINE_SMOOTH_HINT, GL_NICEST);
 
   // Sprites are depth-tested
-  glEnable(GL_DEPTH_TEST);
+  Enable(GL_DEPTH_TEST);
   glDepthFunc(GL_LEQUAL);
 
   Check();
 }
 
+void Mode::Projection(Vec<2> origin, Vec<2> size) {
+  MatrixMode(GL_PROJECTION);
+  glLoadIdentity();
+  glOrtho(origin.x(), origin.x() + size.x(), origin.y() + size.y(),
+          origin.y(), 0.f, -1.f);
+  MatrixMode(GL_MODELVIEW);
+}
+
+void Mode::Clip(Vec<2> origin, Vec<2> size) {
+
+  // Scissor rectangles are in window pixels from the bottom-left corner
+  float scale_x = (float)width$ / width_scaled$;
+  float scale_y = (float)height$ / height_scaled$;
+  int x0 = (int)floorf(origin.x() * scale_x);
+  int y0 = (int)floorf(origin.y() * scale_y);
+  int x1 = (int)ceilf((origin.x() + size.x()) * scale_x);
+  int y1 = (int)ceilf((origin.y() + size.y()) * scale_y);
+  Enable(GL_SCISSOR_TEST);
+  glScissor(x0, height$ - y1, std::max(x1 - x0, 0), std::max(y1 - y0, 0));
+}
+
 void Mode::Begin() {
+  Texture::UploadQueued();
   int clear_flags = GL_DEPTH_BUFFER_BIT;
   if (clear$)
     clear_flags |= GL_COLOR_BUFFER_BIT;
@@ -123,6 +283,7 @@ void Mode::Begin() {
 }
 
 void Mode::End() {
+  SpriteBatch::Flush();
   SDL_GL_SwapBuffers();
   Check();
 }
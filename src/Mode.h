@@ -13,6 +13,7 @@
 #pragma once
 #include "var.h"
 #include "Count.h"
+#include "Vec.h"
 
 namespace dragoon {
 
@@ -39,26 +40,66 @@ public:
   /** End rendering frame */
   static void End();
 
+  /** Enable or disable a capability. Blending, alpha testing, depth testing
+      and texturing are cached and only changed if necessary. */
+  static void Enable(GLenum cap, bool enable = true);
+
+  /** Disable a capability, see Enable() */
+  static void Disable(GLenum cap) { Enable(cap, false); }
+
+  /** Set the blending function if it has changed */
+  static void BlendFunc(GLenum src, GLenum dest);
+
+  /** Set the alpha test function if it has changed */
+  static void AlphaFunc(GLenum func, float ref);
+
+  /** Bind a 2D texture if it is not already bound */
+  static void BindTexture(unsigned int name);
+
+  /** Set the scaling filters of the bound texture if they have changed */
+  static void TextureFilters(GLint min, GLint mag);
+
+  /** Delete a texture and forget its cached state */
+  static void DeleteTexture(unsigned int& name);
+
+  /** Set the texture matrix to a translation and scale if it has changed */
+  static void TextureMatrix(Vec<2> translate, Vec<2> scale);
+
+  /** Apply an additional translation and scale to the texture matrix */
+  static void MultTextureMatrix(Vec<2> translate, Vec<2> scale);
+
+  /** Set the current matrix mode if it has changed */
+  static void MatrixMode(GLenum mode);
+
+  /** Set an orthogonal projection that maps a rectangle onto the screen */
+  static void Projection(Vec<2> origin, Vec<2> size);
+
+  /** Restrict drawing to a rectangle in scaled screen coordinates */
+  static void Clip(Vec<2> origin, Vec<2> size);
+
+  /** Stop restricting drawing to a clip rectangle */
+  static void Unclip() { Disable(GL_SCISSOR_TEST); }
+
+  /** Forget all cached state so that it is set again the next time */
+  static void ResetState();
+
   static int height() { return height_scaled$; }
   static int width() { return width_scaled$; }
   static int scale() { return scale$; }
   static int init_frame() { return init_frame$; }
   static bool fullscreen() { return fullscreen$; }
 
-  /*
-  void clip(Vec<2> origin, CVec size);
-  void R_clip_disable(void);
-  void R_clip_left(float);
-  void R_clip_top(float);
-  void R_clip_right(float);
-  void R_clip_bottom(float);
-  void R_pushClip(void);
-  void R_popClip(void);
-  */
 
   /** Counter for rendered faces */
   static Count faces$;
 
+  /** Counter for issued draw calls */
+  static Count calls$;
+
+  /** Counters for issued and skipped redundant state changes */
+  static Count state_changes$;
+  static Count state_skips$;
+
 private:
   static var::Int target_height$;
   static var::Int height$;
@@ -69,6 +110,30 @@ private:
   static int init_frame$;
   static int scale$;
   static int width_scaled$;
+
+  /** Cached capabilities */
+  enum { CAP_BLEND, CAP_ALPHA_TEST, CAP_DEPTH_TEST, CAP_TEXTURE_2D, CAPS };
+
+  /** Counts a state change as issued or skipped
+   *  @returns true if the change needs to be issued
+   */
+  static bool Change(bool changed) {
+    if (CHECKED)
+      ++(changed ? state_changes$ : state_skips$);
+    return changed;
+  }
+
+  static std::map<unsigned int, std::pair<GLint, GLint> > filters$;
+  static Vec<2> texture_translate$;
+  static Vec<2> texture_scale$;
+  static GLenum blend_src$;
+  static GLenum blend_dest$;
+  static GLenum alpha_func$;
+  static float alpha_ref$;
+  static GLenum matrix_mode$;
+  static unsigned int texture$;
+  static int caps$[CAPS];
+  static bool texture_matrix$;
 };
 
 } // namespace dragoon
@@ -12,94 +12,216 @@
 
 #include "log.h"
 #include "math.h"
-#include "Mode.h"
+#include "os.h"
+#include "str.h"
+#include "Camera.h"
+#include "Jobs.h"
 #include "Sprite.h"
+#include "SpriteBatch.h"
 
 namespace dragoon {
 
+namespace {
+
+  // Size of the level index cells in pixels
+  const float GRID_CELL = 256;
+
+  // Returns true if two rectangles overlap
+  bool Overlap(Vec<2> origin_a, Vec<2> size_a, Vec<2> origin_b,
+               Vec<2> size_b) {
+    return origin_a.x() < origin_b.x() + size_b.x() &&
+           origin_a.y() < origin_b.y() + size_b.y() &&
+           origin_b.x() < origin_a.x() + size_a.x() &&
+           origin_b.y() < origin_a.y() + size_a.y();
+  }
+}
+
+/** Parses a changed sprite config and hashes its nodes on a worker thread.
+    When finished, only the sprites whose nodes changed are rebuilt. */
+class Sprite::ReloadJob: public Jobs::Job {
+public:
+  ReloadJob(const std::string& filename): filename_(filename) {}
+
+  virtual void Run() {
+    config_ = new Config(filename_.c_str());
+    for (const Config::Node* n = config_->root(); n; n = n->next())
+      hashes_.push_back(n->Hash());
+  }
+
+  virtual void Finish() {
+    std::vector<const Config::Node*> changed;
+    std::vector<unsigned int> changed_hashes;
+    int i = 0;
+    for (const Config::Node* n = config_->root(); n; n = n->next(), ++i) {
+      sprites$T::iterator it = n->size() > 1 ? sprites$.find(n->token(1))
+                                             : sprites$.end();
+      if (it == sprites$.end() || it->second->hash_ != hashes_[i]) {
+        changed.push_back(n);
+        changed_hashes.push_back(hashes_[i]);
+      }
+    }
+    DEBUG("Rebuilding %d of %d sprites in '%s'", (int)changed.size(), i,
+          filename_.c_str());
+    for (i = 0; i < (int)changed.size(); ++i)
+      Data::LoadTextures(changed[i], true);
+    for (i = 0; i < (int)changed.size(); ++i)
+      ParseNode(changed[i], true, changed_hashes[i]);
+    ResolveAnims();
+  }
+
+private:
+  ptr::Scope<Config> config_;
+  std::vector<unsigned int> hashes_;
+  std::string filename_;
+};
+
 Sprite::sprites$T Sprite::sprites$;
+var::Bool Sprite::hot_reload$("sprite.hot_reload", CHECKED,
+                              "Reload sprite configs and textures when "
+                              "their files change");
+int Sprite::texture_reloads$;
+Grid<Sprite> Sprite::grid$(GRID_CELL);
+std::vector<Sprite*> Sprite::visible$;
+std::vector<Sprite*> Sprite::layers$;
+
+Sprite::Sprite(const Sprite& s):
+  param::Angle(s), param::Flip(s), param::Mirror(s), param::Modulate(s),
+  param::Origin(s), param::Size(s), param::Z(s), data_(s.data_),
+  placed_(false) {}
+
+Sprite& Sprite::operator=(const Sprite& s) {
+  param::Angle::operator=(s);
+  param::Flip::operator=(s);
+  param::Mirror::operator=(s);
+  param::Modulate::operator=(s);
+  param::Origin::operator=(s);
+  param::Size::operator=(s);
+  param::Z::operator=(s);
+  data_ = s.data_;
+  Index();
+  return *this;
+}
+
+void Sprite::Bounds(Vec<2>& origin, Vec<2>& size) const {
+  const Data* data = frame();
+  if (data && data->tile_ == Data::TILE_PARALLAX) {
+    Camera::View(origin, size);
+    return;
+  }
+  origin = origin_;
+  size = size_;
+
+  // Rotation keeps every point within a diagonal of the pivot, which is
+  // inside the sprite
+  if (angle_ != 0.f) {
+    float diagonal = size_.Len();
+    origin -= diagonal;
+    size += diagonal * 2;
+  }
+}
+
+void Sprite::Index() {
+  if (!placed_)
+    return;
+
+  // Parallax sprites follow the camera, cells would not find them again
+  if (data_ && data_->tile_ == Data::TILE_PARALLAX) {
+    grid$.Remove(this, cells_);
+    if (std::find(layers$.begin(), layers$.end(), this) == layers$.end())
+      layers$.push_back(this);
+    return;
+  }
+  layers$.erase(std::remove(layers$.begin(), layers$.end(), this),
+                layers$.end());
+  Vec<2> origin, size;
+  Bounds(origin, size);
+  grid$.Move(this, cells_, origin, size);
+}
+
+void Sprite::Remove() {
+  if (!placed_)
+    return;
+  grid$.Remove(this, cells_);
+  layers$.erase(std::remove(layers$.begin(), layers$.end(), this),
+                layers$.end());
+  placed_ = false;
+}
+
+void Sprite::DrawVisible() {
+  for (int i = 0; i < (int)layers$.size(); ++i)
+    layers$[i]->Draw();
+  Vec<2> view_origin, view_size;
+  Camera::View(view_origin, view_size);
+  visible$.clear();
+  grid$.Query(view_origin, view_size, visible$);
+  for (int i = 0; i < (int)visible$.size(); ++i)
+    visible$[i]->Draw();
+}
 
 Vec<2> Sprite::Center() const {
-  if (!data_ || !size_.x() || !size_.y() ||
-      !data_->box_size_.x() || !data_->box_size_.y())
+  const Data* data = frame();
+  if (!data || !size_.x() || !size_.y() ||
+      !data->box_size_.x() || !data->box_size_.y())
     return Vec<2>(0, 0);
-  Vec<2> center = data_->center_;
+  Vec<2> center = data->center_;
   if (mirror_)
-    center[0] = data_->box_size_.x() - center[0];
+    center[0] = data->box_size_.x() - center[0];
   if (flip_)
-    center[1] = data_->box_size_.y() - center[1];
-  return center * size_ / data_->box_size_;
+    center[1] = data->box_size_.y() - center[1];
+  return center * size_ / data->box_size_;
 }
 
 void Sprite::Draw() {
-  if (!data_ || z_ < 0.f || modulate_.a() <= 0.f)
+  const Data* data = frame();
+  if (!data || z_ < 0.f || modulate_.a() <= 0.f)
     return;
 
-  // TODO: Check if sprite is on-screen
-  //if (!CVec_intersect(r_cameraOn ? r_camera : CVec(0, 0),
-  //                    CVec(r_widthScaled, r_heightScaled),
-  //                    sprite->origin, sprite->size))
-  //        return;
-
-  // Setup transformation matrix
-  glMatrixMode(GL_MODELVIEW);
-  glPushMatrix();
-  Vec<2> c = size_ / 2;
-  glTranslatef(origin_.x() + c.x(), origin_.y() + c.y(), z_);
-  bool smooth = angle_ != 0.f;
-  if (smooth) {
-    Vec<2> trans = Center() - c;
-    glTranslatef(trans.x(), trans[1], 0);
-    glRotatef(math::RadToDeg(angle_), 0.0, 0.0, 1.0);
-    glTranslatef(-trans.x(), -trans[1], 0);
-  }
+  // Skip sprites that are out of view
+  Vec<2> origin, size, view_origin, view_size;
+  Bounds(origin, size);
+  Camera::View(view_origin, view_size);
+  if (!Overlap(origin, size, view_origin, view_size))
+    return;
 
-  // Flip/mirror texture
-  glScalef(mirror_ ^ data_->mirror_ ? -size_.x() : size_.x(),
-           flip_ ^ data_->flip_ ? -size_.y() : size_.y(), 0);
-
-  // Additive blending
-  if (data_->blend_ == Data::BLEND_ADD) {
-    glEnable(GL_BLEND);
-    glDisable(GL_ALPHA_TEST);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+  // Setup transformation from the unit quad to the screen, parallax
+  // sprites cover their bounds
+  Transform xf;
+  if (data->tile_ != Data::TILE_PARALLAX) {
+    origin = origin_;
+    size = size_;
   }
+  Vec<2> c = size / 2;
+  xf.origin = origin + c;
+  xf.z = z_;
 
-  // Solid color
-  else if (data_->blend_ == Data::BLEND_SOLID) {
-    glDisable(GL_BLEND);
-    glDisable(GL_ALPHA_TEST);
-  }
+  // Flip/mirror texture
+  xf.scale = Vec<2>(mirror_ ^ data->mirror_ ? -size.x() : size.x(),
+                    flip_ ^ data->flip_ ? -size.y() : size.y());
 
-  // Alpha blending
-  else {
-    glEnable(GL_BLEND);
-    glEnable(GL_ALPHA_TEST);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+  // Rotate around the sprite center
+  bool smooth = angle_ != 0.f;
+  if (smooth) {
+    xf.pivot = Center() - c;
+    xf.rotation = Vec<2>(cosf(angle_), sinf(angle_));
   }
 
   // Modulate color
-  Color modulate = modulate_ * data_->modulate_;
-  if (data_->flicker_ > 0)
-    modulate[3] = modulate[3] * (1 - data_->flicker_) +
-                  data_->flicker_ * math::UnitRand();
-  if (data_->blend_ == Data::BLEND_ADD) {
+  Color modulate = modulate_ * data->modulate_;
+  if (data->flicker_ > 0)
+    modulate[3] = modulate[3] * (1 - data->flicker_) +
+                  data->flicker_ * math::UnitRand();
+  if (data->blend_ == Data::BLEND_ADD) {
     modulate *= modulate[3];
     modulate[3] = 1;
-  } else if (data_->blend_ == Data::BLEND_SOLID)
+  } else if (data->blend_ == Data::BLEND_SOLID)
     modulate[3] = 1;
-  modulate.Select();
 
-  // Render the sprite quad(s)
-  smooth |= data_->up_scale_;
-  if (data_->corner_.x() || data_->corner_.y())
-    DrawWindow(smooth);
+  // Submit the sprite quad(s)
+  smooth |= data->up_scale_;
+  if (data->corner_.x() || data->corner_.y())
+    DrawWindow(*data, xf, modulate, smooth);
   else
-    DrawQuad(smooth);
-
-  // Cleanup
-  glPopMatrix();
-  Mode::Check();
+    DrawQuad(*data, xf, modulate, smooth);
 }
 
 const Sprite::Data* Sprite::Get(const char* name) {
@@ -112,13 +234,73 @@ const Sprite::Data* Sprite::Get(const char* name) {
 
 void Sprite::LoadConfig(const char* filename) {
   Config config(filename);
+  if (hot_reload$)
+    os::Watch(filename);
   for (const Config::Node* n = config.root(); n; n = n->next())
-    ParseNode(n);
+    Data::LoadTextures(n, hot_reload$);
+  for (const Config::Node* n = config.root(); n; n = n->next())
+    ParseNode(n, false, hot_reload$ ? n->Hash() : 0);
+  ResolveAnims();
+}
+
+void Sprite::ResolveAnims() {
+  for (sprites$T::iterator it = sprites$.begin(); it != sprites$.end(); ++it) {
+    Data* data = it->second;
+    for (int i = 0; i < (int)data->anim_.size(); ++i) {
+      Data::Frame& frame = data->anim_[i];
+      if (frame.data_)
+        continue;
+      sprites$T::iterator found = sprites$.find(frame.name_);
+      if (found == sprites$.end() || !found->second->anim_.empty()) {
+        WARN("Animation '%s' frame '%s' is not a sprite", it->first.c_str(),
+             frame.name_.c_str());
+        continue;
+      }
+      frame.data_ = found->second;
+      if (!i) {
+        data->box_size_ = frame.data_->box_size_;
+        data->scale_ = frame.data_->scale_;
+      }
+    }
+  }
+}
+
+void Sprite::Reload() {
+  if (!hot_reload$)
+    return;
+  std::string path;
+  while (os::Changed(path)) {
+    if (str::EndsWith(path.c_str(), ".cfg")) {
+      DEBUG("Reloading sprite config '%s'", path.c_str());
+      Jobs::Add(new ReloadJob(path));
+    } else
+      Texture::Reload(path.c_str());
+  }
+
+  // Tiles are cut again from textures that have been reloaded
+  if (texture_reloads$ == Texture::reloads())
+    return;
+  texture_reloads$ = Texture::reloads();
+  for (sprites$T::iterator it = sprites$.begin(); it != sprites$.end(); ++it) {
+    Data* data = it->second;
+    if (data->tile_ && data->texture_ &&
+        data->tiled_version_ != data->texture_->version())
+      data->ExtractTiles();
+  }
 }
 
-const Sprite::Data* Sprite::ParseNode(const Config::Node* node) {
+const Sprite::Data* Sprite::ParseNode(const Config::Node* node, bool reload,
+                                      unsigned int hash) {
   Data* data = Data::ParseNode(node);
+  if (data)
+    data->hash_ = hash;
   if (data && data->name_.size()) {
+    if (reload && sprites$.count(data->name_)) {
+      Data* old = sprites$[data->name_];
+      old->Swap(*data);
+      delete data;
+      return old;
+    }
     if (sprites$.count(data->name_)) {
       WARN("Redeclared sprite '%s'", data->name_.c_str());
       delete data;
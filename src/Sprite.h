@@ -13,26 +13,36 @@
 #pragma once
 #include "param.h"
 #include "Config.h"
+#include "Grid.h"
 #include "Texture.h"
+#include "Timer.h"
 
 namespace dragoon {
 
-/** 2D sprite rendered onto the screen */
+/** 2D sprite rendered onto the screen. The parameters that move the sprite
+    in the level index are inherited privately so that only the setters
+    that update the index can change them. */
 class Sprite:
-  public param::Angle, public param::Flip, public param::Mirror,
-  public param::Modulate, public param::Origin, public param::Size,
+  private param::Angle, public param::Flip, public param::Mirror,
+  public param::Modulate, private param::Origin, private param::Size,
   public param::Z {
 public:
+  using param::Angle::angle;
+  using param::Origin::origin;
+  using param::Size::size;
 
   /** Sprite data information */
   struct Data {
 
     /** Animation frame */
     struct Frame {
-      Frame(const char* name, int msec): name_(name), msec_(msec) {}
+      Frame(const char* name, int msec):
+        name_(name), data_(NULL), msec_(msec), end_msec_(0) {}
 
       std::string name_;
+      const Data* data_; ///< Frame sprite, resolved once loaded
       int msec_;
+      int end_msec_;     ///< Time the frame ends within the animation
     };
 
     /** Tiling mode */
@@ -40,14 +50,15 @@ public:
       TILE_SCALED,   ///< Scale the sprite when it is resized
       TILE_LOCAL,    ///< Tile the sprite relative to its origin
       TILE_GLOBAL,   ///< Tile the sprite relative to global origin
-      TILE_PARALLAX, ///< Global tiling with parallax effect
+      TILE_PARALLAX, ///< Fills the view and scrolls with part of the camera
     };
 
     /** Blending mode */
     enum Blend {
-      BLEND_ALPHA, ///< Alpha-blending translucency
-      BLEND_SOLID, ///< Solid color sprite, no blending
-      BLEND_ADD,   ///< Additive blending
+      BLEND_ALPHA,    ///< Alpha-blending translucency
+      BLEND_SOLID,    ///< Solid color sprite, no blending
+      BLEND_ADD,      ///< Additive blending
+      BLEND_DISTANCE, ///< Alpha is a distance field, tested at its edge
     };
 
     /** Creates an uninitialized Data object */
@@ -56,12 +67,48 @@ public:
     /** Initializes data structures from a sprite config block */
     void ParseFrame(const Config::Node*);
 
+    /** Cut the tiled and window edge textures out of the sprite texture */
+    void ExtractTiles();
+
+    /** Exchange contents with another data object */
+    void Swap(Data&);
+
     /** Initializes data structures from an anim config block */
     void ParseAnim(const Config::Node*);
 
+    /** Compile the animation timeline. Frame start times are summed up and,
+        if the frame durations have a common step that divides the cycle
+        into few enough slots, a table maps each slot to its frame. */
+    void CompileAnim();
+
+    /** Returns the animation frame shown at a time on the shared timeline
+        or \c NULL if the frame has not been resolved */
+    const Data* Animate(int msec) const {
+      if (anim_msec_ <= 0)
+        return anim_.empty() ? NULL : anim_[0].data_;
+      msec %= anim_msec_;
+      if (msec < 0)
+        msec += anim_msec_;
+      if (!anim_table_.empty())
+        return anim_[anim_table_[msec / anim_step_]].data_;
+      int lo = 0, hi = anim_.size() - 1;
+      while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (anim_[mid].end_msec_ <= msec)
+          lo = mid + 1;
+        else
+          hi = mid;
+      }
+      return anim_[lo].data_;
+    }
+
     /** Create and register a sprite from a configuration node */
     static Data* ParseNode(const Config::Node*);
 
+    /** Start loading the textures of a sprite node so they decode in
+        parallel, optionally watching their files for changes */
+    static void LoadTextures(const Config::Node*, bool watch);
+
     /** Returns the natural size of the sprite */
     Vec<2> size() const { return box_size_ * scale_; }
 
@@ -76,12 +123,16 @@ public:
     Vec<2> scale_;
     Vec<2> corner_;
     std::vector<Frame> anim_;
+    std::vector<int> anim_table_;
     std::string name_;
     Tile tile_;
     Blend blend_;
     float parallax_;
     float flicker_;
-    int next_msec_;
+    int anim_msec_;
+    int anim_step_;
+    int tiled_version_;
+    unsigned int hash_; ///< Config node hash, only kept for hot reload
     bool flip_;
     bool mirror_;
     bool up_scale_;
@@ -98,47 +149,141 @@ public:
   };
 #pragma pack(pop)
 
+  /** Transformation from a sprite's unit quad to the screen. The quad is
+      scaled, rotated around the pivot and then moved to the origin. */
+  struct Transform {
+    Transform(): scale(1, 1), rotation(1, 0), z(0) {}
+
+    Vec<2> origin;   ///< Screen position of the quad center
+    Vec<2> scale;    ///< Sprite size, negative to flip or mirror
+    Vec<2> pivot;    ///< Rotation center relative to the quad center
+    Vec<2> rotation; ///< Cosine and sine of the rotation angle
+    float z;
+  };
+
   /** Initialize a sprite by data pointer */
-  Sprite(const Data* data = NULL): data_(data) {
+  Sprite(const Data* data = NULL): data_(data), placed_(false) {
     if (data)
       size_ = data->size();
   }
 
   /** Initialize a sprite by name */
-  Sprite(const char* name) {
+  Sprite(const char* name): placed_(false) {
     if ((data_ = Get(name)))
       size_ = data_->size();
   }
 
+  /** Copies are not placed in the level index */
+  Sprite(const Sprite&);
+
+  /** A placed sprite stays placed and moves with its new parameters */
+  Sprite& operator=(const Sprite&);
+
+  ~Sprite() { Remove(); }
+
+  /** Set origin, updating the level index */
+  void set_origin(Vec<2> origin) {
+    origin_ = origin;
+    Index();
+  }
+
+  /** Set size, updating the level index */
+  void set_size(Vec<2> size) {
+    size_ = size;
+    Index();
+  }
+
+  /** Set rotation angle, updating the level index */
+  void set_angle(float angle) {
+    angle_ = angle;
+    Index();
+  }
+
+  /** Add the sprite to the level index so that DrawVisible() draws it
+      while it is on screen. Parallax sprites always cover the view, they
+      are kept out of the grid and drawn every time. Copies are not placed,
+      so sprites in containers that copy them on growth, like a growing
+      \c std::vector, must be placed after the container stops changing. */
+  void Place() {
+    placed_ = true;
+    Index();
+  }
+
+  /** Remove the sprite from the level index */
+  void Remove();
+
+  /** Rectangle that contains the sprite however it is rotated. Parallax
+      sprites are always the camera view. */
+  void Bounds(Vec<2>& origin, Vec<2>& size) const;
+
   /** Get the sprite center point */
   Vec<2> Center() const;
 
-  /** Draw the sprite on the screen */
+  /** Submit the sprite to the sprite batch for rendering. Animated sprites
+      draw the frame that is current on the shared timeline. */
   void Draw();
 
+  /** Draw every placed sprite that is in the camera view. Parallax layers
+      are drawn first, then only the sprites in the level index cells that
+      overlap the view are looked at. */
+  static void DrawVisible();
+
   /** Get sprite data by name */
   static const Data* Get(const char* name);
 
   /** Load sprite config file */
   static void LoadConfig(const char* filename);
 
-  /** Create and register a sprite from a configuration node */
-  static const Data* ParseNode(const Config::Node*);
+  /** Create and register a sprite from a configuration node. Reloaded
+      sprites replace the contents of the data they were declared with, so
+      existing sprites show the new data.
+   *  @param hash  Hash of the node, compared when the config is reloaded
+   */
+  static const Data* ParseNode(const Config::Node*, bool reload = false,
+                               unsigned int hash = 0);
+
+  /** Reload changed sprite configs and textures. Call once per frame right
+      after jobs are polled, the reloaded data is swapped in by the next
+      poll. Tiles are cut again from textures swapped in by the last one. */
+  static void Reload();
 
 private:
   typedef ptr::Scope<Data>::Map<const std::string> sprites$T;
+  class ReloadJob;
+
+  /** Returns the data of the frame to draw, for animations the frame that
+      is current on the shared timeline */
+  const Data* frame() const {
+    return data_ && !data_->anim_.empty() ? data_->Animate(Timer::time())
+                                          : data_;
+  }
+
+  /** Update the cells of a placed sprite in the level index */
+  void Index();
+
+  /** Resolve the frame names of animations that have not been resolved.
+      Animations take the natural size of their first frame. */
+  static void ResolveAnims();
 
   /** Renders a single quad sprite */
-  void DrawQuad(bool smooth);
+  void DrawQuad(const Data&, const Transform&, Color modulate, bool smooth);
 
   /** Renders a window sprite. A window sprite is composed of a grid of nine
       quads where the corner quads have a fixed size and the connecting quads
       stretch to fill the rest of the sprite size. */
-  void DrawWindow(bool smooth);
+  void DrawWindow(const Data&, const Transform&, Color modulate,
+                  bool smooth);
 
   static sprites$T sprites$;
+  static var::Bool hot_reload$;
+  static int texture_reloads$;
+  static Grid<Sprite> grid$;
+  static std::vector<Sprite*> visible$;
+  static std::vector<Sprite*> layers$;
 
   const Data *data_;
+  Grid<Sprite>::Cells cells_;
+  bool placed_;
 };
 
 } // namespace dragoon
@@ -11,10 +11,55 @@
 \******************************************************************************/
 
 #include "../log.h"
+#include "../math.h"
+#include "../os.h"
 #include "../Sprite.h"
 
 namespace dragoon {
 
+namespace {
+
+  // Top-level nodes
+  enum { NODE_SPRITE, NODE_ANIM };
+  const char* const NODE_NAMES[] = { "sprite", "anim", NULL };
+  const Config::Keywords node_keywords(NODE_NAMES);
+
+  // Sprite frame commands
+  enum {
+    FRAME_FILE,
+    FRAME_COLOR,
+    FRAME_FLIP,
+    FRAME_MIRROR,
+    FRAME_BOX,
+    FRAME_CENTER,
+    FRAME_SCALE,
+    FRAME_UPSCALE,
+    FRAME_WINDOW,
+    FRAME_FLICKER,
+    FRAME_TILE,
+    FRAME_BLEND,
+  };
+  const char* const FRAME_NAMES[] = {
+    "file", "color", "flip", "mirror", "box", "center", "scale", "upscale",
+    "window", "flicker", "tile", "blend", NULL
+  };
+  const Config::Keywords frame_keywords(FRAME_NAMES);
+
+  // Blend modes in the order of Sprite::Data::Blend
+  const char* const BLEND_NAMES[] = {
+    "alpha", "solid", "add", "distance", NULL
+  };
+  const Config::Keywords blend_keywords(BLEND_NAMES);
+
+  // Tile command options, "tile global parallax <fraction>"
+  enum { TILE_OPTION_GLOBAL, TILE_OPTION_PARALLAX };
+  const char* const TILE_NAMES[] = { "global", "parallax", NULL };
+  const Config::Keywords tile_keywords(TILE_NAMES);
+
+  // Longest animation timeline compiled into a lookup table, in steps
+  const int ANIM_TABLE_MAX = 1024;
+}
+
 Sprite::Data::Data():
   texture_(NULL),
   modulate_(1, 1, 1, 1),
@@ -23,6 +68,10 @@ Sprite::Data::Data():
   blend_(BLEND_ALPHA),
   parallax_(0),
   flicker_(0),
+  anim_msec_(0),
+  anim_step_(0),
+  tiled_version_(0),
+  hash_(0),
   flip_(false),
   mirror_(false),
   up_scale_(false)
@@ -34,102 +83,128 @@ void Sprite::Data::ParseFrame(const Config::Node* n) {
   for (n = n->child(); n; n = n->next()) {
     const Config::Node* c = n->child();
 
+    // Some commands must be the whole node
+    int keyword = frame_keywords.Find(n);
+    switch (keyword) {
+    case FRAME_COLOR:
+    case FRAME_FLIP:
+    case FRAME_MIRROR:
+    case FRAME_BOX:
+    case FRAME_CENTER:
+    case FRAME_UPSCALE:
+    case FRAME_WINDOW:
+      if (n->size() != 1)
+        keyword = -1;
+      break;
+    default:
+      break;
+    }
+    switch (keyword) {
+
     // Texture file
-    if (n->Match(0, "file"))
+    case FRAME_FILE:
       texture_ = Texture::Load(n->token(1));
+      break;
 
     // Modulation color
-    else if (n->Match("color")) {
+    case FRAME_COLOR:
       if (c)
         modulate_ = Color(atof(c->token(0)) / 255.f, atof(c->token(1)) / 255.f,
                           atof(c->token(2)) / 255.f, atof(c->token(3)) / 255.f);
       else
         WARN("Expected child block for color in %s:%d",
              n->filename(), n->line());
-    }
+      break;
 
     // Flip and mirror
-    else if (n->Match("flip"))
+    case FRAME_FLIP:
       flip_ = true;
-    else if (n->Match("mirror"))
+      break;
+    case FRAME_MIRROR:
       mirror_ = true;
+      break;
 
     // Bounding box origin and size
-    else if (n->Match("box")) {
+    case FRAME_BOX:
       if (c) {
         box_origin_ = Vec<2>(atof(c->token(0)), atof(c->token(1)));
         box_size_ = Vec<2>(atof(c->token(2)), atof(c->token(3)));
         have_box = true;
       } else
         WARN("Expected child block for box in %s:%d", n->filename(), n->line());
-    }
+      break;
 
     // Bounding box center
-    else if (n->Match("center")) {
+    case FRAME_CENTER:
       if (c) {
         center_ = Vec<2>(atof(c->token(0)), atof(c->token(1)));
         have_center = true;
       } else
         WARN("Expected child block for center in %s:%d",
              n->filename(), n->line());
-    }
+      break;
 
     // Scale factor
-    else if (n->Match(0, "scale"))
+    case FRAME_SCALE:
       scale_ = c ? Vec<2>(atof(c->token(0)), atof(c->token(1)))
                  : Vec<2>(atof(n->token(1)), atof(n->token(1)));
+      break;
 
     // Force upscale
-    else if (n->Match("upscale"))
+    case FRAME_UPSCALE:
       up_scale_ = true;
+      break;
 
     // Window sprite
-    else if (n->Match("window")) {
+    case FRAME_WINDOW:
       if (c)
         corner_ = Vec<2>(atof(c->token(0)), atof(c->token(1)));
       else
         WARN("Expected child block for window in %s:%d",
              n->filename(), n->line());
-    }
+      break;
 
     // Flicker alpha
-    else if (n->Match(0, "flicker"))
+    case FRAME_FLICKER:
       flicker_ = atof(n->token(1));
+      break;
 
     // Tile
-    else if (n->Match(0, "tile")) {
+    case FRAME_TILE:
       if (n->size() == 1) {
         tile_ = TILE_LOCAL;
         if (c)
           tile_origin_ = Vec<2>(atof(c->token(0)), atof(c->token(1)));
-      } else if (n->Match(1, "global")) {
+      } else if (tile_keywords.Find(n, 1) == TILE_OPTION_GLOBAL) {
         tile_ = TILE_GLOBAL;
-        if (c) {
+        if (c)
           tile_origin_ = Vec<2>(atof(c->token(0)), atof(c->token(1)));
+
+        // Parallax layers
+        if (tile_keywords.Find(n, 2) == TILE_OPTION_PARALLAX) {
+          tile_ = TILE_PARALLAX;
           parallax_ = atof(n->token(3));
         }
       } else
         WARN("Unrecognized tile command '%s' in %s:%d",
              n->c_str(), n->filename(), n->line());
-    }
+      break;
 
-    // Blend mode
-    else if (n->Match(0, "blend")) {
-      if (n->Match(1, "solid"))
-        blend_ = BLEND_SOLID;
-      else if (n->Match(1, "alpha"))
-        blend_ = BLEND_ALPHA;
-      else if (n->Match(1, "add"))
-        blend_ = BLEND_ADD;
+    // Blend mode, keyword ids are the blend modes
+    case FRAME_BLEND:
+      keyword = blend_keywords.Find(n, 1);
+      if (keyword >= 0)
+        blend_ = (Blend)keyword;
       else
         WARN("Unrecognized blend command '%s' in %s:%d",
              n->c_str(), n->filename(), n->line());
-    }
+      break;
 
     // Unrecognized command
-    else
+    default:
       WARN("Unrecognized sprite command '%s' in %s:%d",
            n->c_str(), n->filename(), n->line());
+    }
   }
 
   // Defaults
@@ -138,46 +213,100 @@ void Sprite::Data::ParseFrame(const Config::Node* n) {
   if (!have_center)
     center_ = box_size_ / 2.f;
 
-  // Create tiled window subtextures
-  if (tile_) {
-
-    // Window tiling
-    if (corner_[0] || corner_[1]) {
-      Vec<2> origin = box_origin_ + corner_;
-      Vec<2> size = box_size_ - corner_ * 2;
-      tiled_ = texture_->Extract(origin[0], origin[1], size[0], size[1]);
-
-      // Extract edges: top, left, right, bottom
-      edges_[0] = texture_->Extract(origin[0], box_origin_[1],
-                                    size[0], corner_[1]);
-      edges_[1] = texture_->Extract(box_origin_[0], origin[1],
-                                    corner_[0], size[1]);
-      edges_[2] = texture_->Extract(box_origin_[0] + size[0], origin[1],
-                                    corner_[0], size[1]);
-      edges_[3] = texture_->Extract(origin[0], origin[1] + size[1],
-                                    size[0], corner_[1]);
-    }
+  ExtractTiles();
+}
 
-    // Non-window tiling
-    else
-      tiled_ = texture_->Extract(box_origin_[0], box_origin_[1],
-                                 box_size_[0], box_size_[1]);
+void Sprite::Data::ExtractTiles() {
+  tiled_.Release();
+  for (int i = 0; i < 4; ++i)
+    edges_[i].Release();
+  if (!tile_ || !texture_)
+    return;
+  tiled_version_ = texture_->version();
+
+  // Window tiling
+  if (corner_[0] || corner_[1]) {
+    Vec<2> origin = box_origin_ + corner_;
+    Vec<2> size = box_size_ - corner_ * 2;
+    tiled_ = texture_->Extract(origin[0], origin[1], size[0], size[1]);
+
+    // Extract edges: top, left, right, bottom
+    edges_[0] = texture_->Extract(origin[0], box_origin_[1],
+                                  size[0], corner_[1]);
+    edges_[1] = texture_->Extract(box_origin_[0], origin[1],
+                                  corner_[0], size[1]);
+    edges_[2] = texture_->Extract(box_origin_[0] + size[0], origin[1],
+                                  corner_[0], size[1]);
+    edges_[3] = texture_->Extract(origin[0], origin[1] + size[1],
+                                  size[0], corner_[1]);
   }
+
+  // Non-window tiling
+  else
+    tiled_ = texture_->Extract(box_origin_[0], box_origin_[1],
+                               box_size_[0], box_size_[1]);
+}
+
+void Sprite::Data::Swap(Data& other) {
+  std::swap(texture_, other.texture_);
+  tiled_.Swap(other.tiled_);
+  for (int i = 0; i < 4; ++i)
+    edges_[i].Swap(other.edges_[i]);
+  std::swap(modulate_, other.modulate_);
+  std::swap(box_origin_, other.box_origin_);
+  std::swap(box_size_, other.box_size_);
+  std::swap(tile_origin_, other.tile_origin_);
+  std::swap(center_, other.center_);
+  std::swap(scale_, other.scale_);
+  std::swap(corner_, other.corner_);
+  anim_.swap(other.anim_);
+  anim_table_.swap(other.anim_table_);
+  name_.swap(other.name_);
+  std::swap(tile_, other.tile_);
+  std::swap(blend_, other.blend_);
+  std::swap(parallax_, other.parallax_);
+  std::swap(flicker_, other.flicker_);
+  std::swap(anim_msec_, other.anim_msec_);
+  std::swap(anim_step_, other.anim_step_);
+  std::swap(tiled_version_, other.tiled_version_);
+  std::swap(hash_, other.hash_);
+  std::swap(flip_, other.flip_);
+  std::swap(mirror_, other.mirror_);
+  std::swap(up_scale_, other.up_scale_);
 }
 
 void Sprite::Data::ParseAnim(const Config::Node* n) {
   for (n = n->child(); n; n = n->next())
     anim_.push_back(Frame(n->token(0), atoi(n->token(1))));
+  CompileAnim();
+}
+
+void Sprite::Data::CompileAnim() {
+  anim_msec_ = anim_step_ = 0;
+  anim_table_.clear();
+  for (int i = 0; i < (int)anim_.size(); ++i) {
+    int msec = std::max(anim_[i].msec_, 0);
+    anim_[i].end_msec_ = anim_msec_ += msec;
+    if (msec)
+      anim_step_ = math::Gcd(anim_step_, msec);
+  }
+  if (anim_msec_ <= 0 || anim_msec_ / anim_step_ > ANIM_TABLE_MAX)
+    return;
+  anim_table_.resize(anim_msec_ / anim_step_);
+  for (int i = 0, slot = 0; i < (int)anim_.size(); ++i)
+    for (; slot * anim_step_ < anim_[i].end_msec_; ++slot)
+      anim_table_[slot] = i;
 }
 
 Sprite::Data* Sprite::Data::ParseNode(const Config::Node* n) {
 
   // Animations and sprite frames are parsed differently
   Data* d = new Data();
-  ASSERT(n->Match(0, "sprite") || n->Match(0, "anim"));
-  if (n->Match(0, "anim"))
+  int keyword = node_keywords.Find(n);
+  ASSERT(keyword >= 0);
+  if (keyword == NODE_ANIM)
     d->ParseAnim(n);
-  else if (n->Match(0, "sprite"))
+  else if (keyword == NODE_SPRITE)
     d->ParseFrame(n);
 
   // Assign name
@@ -187,4 +316,15 @@ Sprite::Data* Sprite::Data::ParseNode(const Config::Node* n) {
   return d;
 }
 
+void Sprite::Data::LoadTextures(const Config::Node* n, bool watch) {
+  if (node_keywords.Find(n) != NODE_SPRITE)
+    return;
+  for (const Config::Node* c = n->child(); c; c = c->next())
+    if (frame_keywords.Find(c) == FRAME_FILE) {
+      Texture::Load(c->token(1));
+      if (watch)
+        os::Watch(c->token(1));
+    }
+}
+
 } // namespace dragoon
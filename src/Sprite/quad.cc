@@ -11,76 +11,61 @@
 \******************************************************************************/
 
 #include "../log.h"
-#include "../Mode.h"
+#include "../Camera.h"
 #include "../Sprite.h"
+#include "../SpriteBatch.h"
 
 namespace dragoon {
 
-void Sprite::DrawQuad(bool smooth) {
+void Sprite::DrawQuad(const Data& data, const Transform& xf, Color modulate,
+                      bool smooth) {
 
   // Select texture
-  Texture* tex = data_->texture_;
-  if (data_->tile_) {
-    tex = data_->tiled_;
+  Texture* tex = data.texture_;
+  if (data.tile_) {
+    tex = data.tiled_;
     ASSERT(tex);
 
     // Non-power-of-two tiles need to be upscaled
-    smooth |= data_->tile_ && tex->pow2_size() != tex->size();
+    smooth |= data.tile_ && tex->pow2_size() != tex->size();
   }
-  if (tex)
-    tex->Select(smooth);
-
-  // Setup textured quad vertex positions
-  Vertex verts[4];
-  verts[0].co = Vec<2>(-0.5f, -0.5f);
-  verts[0].z = 0.f;
-  verts[2].co = Vec<2>(0.5f, 0.5f);
-  verts[2].z = 0.f;
-  verts[1].co = Vec<2>(-0.5f, 0.5f);
-  verts[1].z = 0.f;
-  verts[3].co = Vec<2>(0.5f, -0.5f);
-  verts[3].z = 0.f;
 
   // Setup vertex UV coordinates
-  Vec<2> origin;
+  Vec<2> origin, uv0, uv1;
   Vec<2> surface_sz(0, 0);
   if (tex)
     surface_sz = tex->size();
-  if (data_->tile_ == Data::TILE_GLOBAL) {
-    origin = origin_ + data_->tile_origin_;
-    verts[0].uv = origin / surface_sz;
-    verts[2].uv = (origin + size_) / surface_sz;
-  } else if (data_->tile_ == Data::TILE_PARALLAX) {
-    origin = origin + data_->tile_origin_; //- camera$ * data_->parallax_;
-    verts[0].uv = origin / surface_sz;
-    verts[2].uv = (origin + size_) / surface_sz;
-  } else if (data_->tile_) {
-    verts[0].uv = Vec<2>(0, 0);
-    verts[2].uv = size_ / surface_sz;
+  if (data.tile_ == Data::TILE_GLOBAL) {
+    origin = origin_ + data.tile_origin_;
+    uv0 = origin / surface_sz;
+    uv1 = (origin + size_) / surface_sz;
+  } else if (data.tile_ == Data::TILE_PARALLAX) {
+
+    // One quad covers the view and the wrapped texture scrolls with part of
+    // the camera movement
+    Vec<2> view_origin, view_size;
+    Camera::View(view_origin, view_size);
+    origin = origin_ + data.tile_origin_ + view_origin * data.parallax_;
+    uv0 = origin / surface_sz;
+    uv1 = (origin + view_size) / surface_sz;
+  } else if (data.tile_) {
+    uv0 = Vec<2>(0, 0);
+    uv1 = size_ / surface_sz;
   } else {
-    verts[0].uv = data_->box_origin_ / surface_sz;
-    verts[2].uv = (data_->box_origin_ + data_->box_size_) / surface_sz;
+    uv0 = data.box_origin_ / surface_sz;
+    uv1 = (data.box_origin_ + data.box_size_) / surface_sz;
   }
 
   // Scale UV for tiled sprites
-  if (data_->tile_) {
-    verts[0].uv /= data_->scale_;
-    verts[2].uv /= data_->scale_;
+  if (data.tile_) {
+    uv0 /= data.scale_;
+    uv1 /= data.scale_;
   }
 
-  verts[1].uv[0] = verts[0].uv[0];
-  verts[1].uv[1] = verts[2].uv[1];
-  verts[3].uv[0] = verts[2].uv[0];
-  verts[3].uv[1] = verts[0].uv[1];
-
-  // Render textured quad
-  if (CHECKED)
-    Mode::faces$ += 2;
-  glInterleavedArrays(Vertex::FORMAT, 0, verts);
-  const unsigned short indices[] = { 0, 1, 2, 3, 0 };
-  glDrawElements(GL_QUADS, 4, GL_UNSIGNED_SHORT, indices);
-
-  Mode::Check();
+  // Submit textured quad
+  SpriteBatch::Add(SpriteBatch::State(tex, data.blend_, smooth), xf,
+                   Vec<2>(-0.5f, -0.5f), Vec<2>(0.5f, 0.5f), uv0, uv1,
+                   modulate);
 }
 
 } // namespace dragoon
@@ -10,177 +10,94 @@
  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
 \******************************************************************************/
 
-#include "../Mode.h"
 #include "../Sprite.h"
+#include "../SpriteBatch.h"
 
 namespace dragoon {
 
-void Sprite::DrawWindow(bool smooth) {
+void Sprite::DrawWindow(const Data& data, const Transform& xf,
+                        Color modulate, bool smooth) {
 
   // If the window dimensions are too small to fit the corners in,
   // we need to trim the corner size a little
-  Vec<2> corner = data_->corner_;
+  Vec<2> corner = data.corner_;
   if (size_.x() <= corner.x() * 2)
     corner[0] = size_.x() / 2;
   if (size_.y() <= corner.y() * 2)
     corner[1] = size_.y() / 2;
-  Vec<2> surface_sz = data_->texture_->size();
-  Vec<2> uv_sz = data_->box_size_ / surface_sz;
+  Vec<2> surface_sz = data.texture_->size();
+  Vec<2> uv_sz = data.box_size_ / surface_sz;
   Vec<2> corner_uv = corner / surface_sz;
   corner /= size_;
 
-  // The vertex array is indexed this way:
+  // The window is a grid of quads with these edge coordinates:
   //
-  //   0---2------4---6
-  //   |   |      |   |
-  //   1---3------5---7
-  //   |   |      |   |
-  //   |   |      |   |
-  //   11--10-----9---8
-  //   |   |      |   |
-  //   12--13-----14--15
+  //   y0 +---+------+---+
+  //      |   |      |   |
+  //   y1 +---+------+---+
+  //      |   |      |   |
+  //      |   |      |   |
+  //   y2 +---+------+---+
+  //      |   |      |   |
+  //   y3 +---+------+---+
+  //      x0  x1     x2  x3
   //
-  Vertex verts[16];
-
-  // Vertex coordinates
-  verts[0].co = Vec<2>(-0.5, -0.5);
-  verts[1].co = Vec<2>(-0.5, -0.5 + corner.y());
-  verts[2].co = Vec<2>(-0.5 + corner.x(), -0.5);
-  verts[3].co = Vec<2>(-0.5 + corner.x(), -0.5 + corner.y());
-  verts[4].co = Vec<2>(0.5 - corner.x(), -0.5);
-  verts[5].co = Vec<2>(0.5 - corner.x(), -0.5 + corner.y());
-  verts[6].co = Vec<2>(0.5, -0.5);
-  verts[7].co = Vec<2>(0.5, -0.5 + corner.y());
-  verts[8].co = Vec<2>(0.5, 0.5 - corner.y());
-  verts[9].co = Vec<2>(0.5 - corner.x(), 0.5 - corner.y());
-  verts[10].co = Vec<2>(-0.5 + corner.x(), 0.5 - corner.y());
-  verts[11].co = Vec<2>(-0.5, 0.5 - corner.y());
-  verts[12].co = Vec<2>(-0.5, 0.5);
-  verts[13].co = Vec<2>(-0.5 + corner.x(), 0.5);
-  verts[14].co = Vec<2>(0.5 - corner.x(), 0.5);
-  verts[15].co = Vec<2>(0.5, 0.5);
-
-  // Vertex UVs
-  verts[0].uv = data_->box_origin_ / surface_sz;
-  verts[1].uv = Vec<2>(verts[0].uv.x(), verts[0].uv.y() + corner_uv.y());
-  verts[2].uv = Vec<2>(verts[0].uv.x()+ corner_uv.x(), verts[0].uv.y());
-  verts[3].uv = Vec<2>(verts[2].uv.x(), verts[1].uv.y());
-  verts[4].uv = Vec<2>(verts[0].uv.x()+ uv_sz.x()- corner_uv.x(),
-                       verts[0].uv.y());
-  verts[5].uv = Vec<2>(verts[4].uv.x(), verts[1].uv.y());
-  verts[6].uv = Vec<2>(verts[0].uv.x()+ uv_sz.x(), verts[0].uv.y());
-  verts[7].uv = Vec<2>(verts[6].uv.x(), verts[1].uv.y());
-  verts[8].uv = Vec<2>(verts[6].uv.x(),
-                       verts[0].uv.y() + uv_sz.y() - corner_uv.y());
-  verts[9].uv = Vec<2>(verts[4].uv.x(), verts[8].uv.y());
-  verts[10].uv = Vec<2>(verts[2].uv.x(), verts[8].uv.y());
-  verts[11].uv = Vec<2>(verts[0].uv.x(), verts[8].uv.y());
-  verts[12].uv = Vec<2>(verts[0].uv.x(), verts[0].uv.y() + uv_sz.y());
-  verts[13].uv = Vec<2>(verts[2].uv.x(), verts[12].uv.y());
-  verts[14].uv = Vec<2>(verts[4].uv.x(), verts[12].uv.y());
-  verts[15].uv = Vec<2>(verts[6].uv.x(), verts[12].uv.y());
-
-  // Untiled quads can be rendered in one call
-  if (!data_->tile_) {
-    unsigned short indices[] = {
-      0, 1, 3, 2,
-      2, 3, 5, 4,
-      4, 5, 7, 6,
-      1, 11, 10, 3,
-      3, 10, 9, 5,
-      5, 9, 8, 7,
-      11, 12, 13, 10,
-      10, 13, 14, 9,
-      9, 14, 15, 8,
-    };
-    data_->texture_->Select(smooth);
-    glInterleavedArrays(Vertex::FORMAT, 0, verts);
-    glDrawElements(GL_QUADS, 36, GL_UNSIGNED_SHORT, indices);
-  }
-
-  // The tiled portions of the window must be rendered separately
-  else {
-
-    // Corner proportion of tiled texture
-    Vec<2> corner_prop = size_ / 2 / data_->corner_;
-    if (corner_prop.x()> 1)
-      corner_prop[0] = 1;
-    if (corner_prop.y() > 1)
-      corner_prop[1] = 1;
-
-    // First render the non-tiling portions
-    unsigned short indices[] = {
-      0, 1, 3, 2,
-      4, 5, 7, 6,
-      11, 12, 13, 10,
-      9, 14, 15, 8,
-    };
-    data_->texture_->Select(smooth);
-    glInterleavedArrays(Vertex::FORMAT, 0, verts);
-    glDrawElements(GL_QUADS, 16, GL_UNSIGNED_SHORT, indices);
-
-    // Top quad
-    data_->edges_[0]->Select(smooth);
-    Vec<2> corners = data_->corner_ * 2;
-    uv_sz = (size_ - corners) / (data_->box_size_ - corners);
-    Vertex t_verts[4];
-    t_verts[0].co = verts[2].co;
-    t_verts[1].co = verts[3].co;
-    t_verts[2].co = verts[5].co;
-    t_verts[3].co = verts[4].co;
-    t_verts[0].uv = Vec<2>(0, 0);
-    t_verts[1].uv = Vec<2>(0, corner_prop.y());
-    t_verts[2].uv = Vec<2>(uv_sz.x(), corner_prop.y());
-    t_verts[3].uv = Vec<2>(uv_sz.x(), 0);
-    glInterleavedArrays(Vertex::FORMAT  , 0, t_verts);
-    glDrawArrays(GL_QUADS, 0, 4);
-
-    // Bottom quad
-    data_->edges_[3]->Select(smooth);
-    t_verts[0].co = verts[10].co;
-    t_verts[1].co = verts[13].co;
-    t_verts[2].co = verts[14].co;
-    t_verts[3].co = verts[9].co;
-    glInterleavedArrays(Vertex::FORMAT, 0, t_verts);
-    glDrawArrays(GL_QUADS, 0, 4);
-
-    // Left quad
-    data_->edges_[1]->Select(smooth);
-    t_verts[0].co = verts[1].co;
-    t_verts[1].co = verts[11].co;
-    t_verts[2].co = verts[10].co;
-    t_verts[3].co = verts[3].co;
-    t_verts[1].uv = Vec<2>(0, uv_sz.y());
-    t_verts[2].uv = Vec<2>(corner_prop.x(), uv_sz.y());
-    t_verts[3].uv = Vec<2>(corner_prop.x(), 0);
-    glInterleavedArrays(Vertex::FORMAT, 0, t_verts);
-    glDrawArrays(GL_QUADS, 0, 4);
-
-    // Right quad
-    data_->edges_[2]->Select(smooth);
-    t_verts[0].co = verts[5].co;
-    t_verts[1].co = verts[9].co;
-    t_verts[2].co = verts[8].co;
-    t_verts[3].co = verts[7].co;
-    glInterleavedArrays(Vertex::FORMAT, 0, t_verts);
-    glDrawArrays(GL_QUADS, 0, 4);
-
-    // Middle quad
-    data_->tiled_->Select(smooth);
-    t_verts[0].co = verts[3].co;
-    t_verts[1].co = verts[10].co;
-    t_verts[2].co = verts[9].co;
-    t_verts[3].co = verts[5].co;
-    t_verts[1].uv = Vec<2>(0, uv_sz.y());
-    t_verts[2].uv = Vec<2>(uv_sz.x(), uv_sz.y());
-    t_verts[3].uv = Vec<2>(uv_sz.x(), 0);
-    glInterleavedArrays(Vertex::FORMAT, 0, t_verts);
-    glDrawArrays(GL_QUADS, 0, 4);
-  }
-
-  if (CHECKED)
-    Mode::faces$ += 18;
-  Mode::Check();
+  float co_x[4] = { -0.5f, -0.5f + corner.x(), 0.5f - corner.x(), 0.5f };
+  float co_y[4] = { -0.5f, -0.5f + corner.y(), 0.5f - corner.y(), 0.5f };
+
+  // Edge UVs on the window texture
+  Vec<2> uv0 = data.box_origin_ / surface_sz;
+  float uv_x[4] = { uv0.x(), uv0.x() + corner_uv.x(),
+                    uv0.x() + uv_sz.x() - corner_uv.x(), uv0.x() + uv_sz.x() };
+  float uv_y[4] = { uv0.y(), uv0.y() + corner_uv.y(),
+                    uv0.y() + uv_sz.y() - corner_uv.y(), uv0.y() + uv_sz.y() };
+
+  // Untiled quads all come from the window texture, tiled windows only take
+  // the corners from it
+  SpriteBatch::State state(data.texture_, data.blend_, smooth);
+  int step = data.tile_ ? 2 : 1;
+  for (int y = 0; y < 3; y += step)
+    for (int x = 0; x < 3; x += step)
+      SpriteBatch::Add(state, xf, Vec<2>(co_x[x], co_y[y]),
+                       Vec<2>(co_x[x + 1], co_y[y + 1]),
+                       Vec<2>(uv_x[x], uv_y[y]),
+                       Vec<2>(uv_x[x + 1], uv_y[y + 1]), modulate);
+  if (!data.tile_)
+    return;
+
+  // Corner proportion of tiled texture
+  Vec<2> corner_prop = size_ / 2 / data.corner_;
+  if (corner_prop.x()> 1)
+    corner_prop[0] = 1;
+  if (corner_prop.y() > 1)
+    corner_prop[1] = 1;
+  Vec<2> corners = data.corner_ * 2;
+  uv_sz = (size_ - corners) / (data.box_size_ - corners);
+
+  // Top and bottom quads
+  state.texture = data.edges_[0];
+  SpriteBatch::Add(state, xf, Vec<2>(co_x[1], co_y[0]),
+                   Vec<2>(co_x[2], co_y[1]), Vec<2>(0, 0),
+                   Vec<2>(uv_sz.x(), corner_prop.y()), modulate);
+  state.texture = data.edges_[3];
+  SpriteBatch::Add(state, xf, Vec<2>(co_x[1], co_y[2]),
+                   Vec<2>(co_x[2], co_y[3]), Vec<2>(0, 0),
+                   Vec<2>(uv_sz.x(), corner_prop.y()), modulate);
+
+  // Left and right quads
+  state.texture = data.edges_[1];
+  SpriteBatch::Add(state, xf, Vec<2>(co_x[0], co_y[1]),
+                   Vec<2>(co_x[1], co_y[2]), Vec<2>(0, 0),
+                   Vec<2>(corner_prop.x(), uv_sz.y()), modulate);
+  state.texture = data.edges_[2];
+  SpriteBatch::Add(state, xf, Vec<2>(co_x[2], co_y[1]),
+                   Vec<2>(co_x[3], co_y[2]), Vec<2>(0, 0),
+                   Vec<2>(corner_prop.x(), uv_sz.y()), modulate);
+
+  // Middle quad
+  state.texture = data.tiled_;
+  SpriteBatch::Add(state, xf, Vec<2>(co_x[1], co_y[1]),
+                   Vec<2>(co_x[2], co_y[2]), Vec<2>(0, 0), uv_sz, modulate);
 }
 
 } // namespace dragoon
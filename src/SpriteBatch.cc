@@ -0,0 +1,292 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#include "log.h"
+#include "math.h"
+#include "Mode.h"
+#include "SpriteBatch.h"
+
+namespace dragoon {
+
+namespace {
+
+  // Vector operations for the transform kernel
+#if defined(__AVX2__)
+  enum { SIMD_WIDTH = 8 };
+  typedef __m256 Floats;
+  inline Floats LoadF(const float* p) { return _mm256_loadu_ps(p); }
+  inline void StoreF(float* p, Floats a) { _mm256_storeu_ps(p, a); }
+  inline Floats AddF(Floats a, Floats b) { return _mm256_add_ps(a, b); }
+  inline Floats SubF(Floats a, Floats b) { return _mm256_sub_ps(a, b); }
+  inline Floats MulF(Floats a, Floats b) { return _mm256_mul_ps(a, b); }
+#elif defined(__SSE2__)
+  enum { SIMD_WIDTH = 4 };
+  typedef __m128 Floats;
+  inline Floats LoadF(const float* p) { return _mm_loadu_ps(p); }
+  inline void StoreF(float* p, Floats a) { _mm_storeu_ps(p, a); }
+  inline Floats AddF(Floats a, Floats b) { return _mm_add_ps(a, b); }
+  inline Floats SubF(Floats a, Floats b) { return _mm_sub_ps(a, b); }
+  inline Floats MulF(Floats a, Floats b) { return _mm_mul_ps(a, b); }
+#endif
+
+  // Write the four vertices of quad i given its corner positions. Corners
+  // are wound the same way as a single sprite quad.
+  inline void Emit(const SpriteBatch::Quads& q, int i,
+                   const float x[4], const float y[4],
+                   SpriteBatch::Vertex* v) {
+    v[0].uv = Vec<2>(q.uv_x0[i], q.uv_y0[i]);
+    v[1].uv = Vec<2>(q.uv_x0[i], q.uv_y1[i]);
+    v[2].uv = Vec<2>(q.uv_x1[i], q.uv_y1[i]);
+    v[3].uv = Vec<2>(q.uv_x1[i], q.uv_y0[i]);
+    for (int j = 0; j < 4; ++j) {
+      memcpy(v[j].color, &q.color[i], sizeof (v[j].color));
+      v[j].co = Vec<2>(x[j], y[j]);
+      v[j].z = q.z[i];
+    }
+  }
+}
+
+SpriteBatch::Quads SpriteBatch::soa$;
+std::vector<SpriteBatch::Vertex> SpriteBatch::vertices$;
+std::vector<SpriteBatch::Quad> SpriteBatch::quads$;
+std::vector<unsigned int> SpriteBatch::indices$;
+std::vector<Vec<2> > SpriteBatch::offsets$;
+Vec<2> SpriteBatch::offset$;
+
+void SpriteBatch::Quads::Add(const Sprite::Transform& xf,
+                             Vec<2> co0, Vec<2> co1, Vec<2> uv0, Vec<2> uv1,
+                             unsigned int rgba) {
+  origin_x.push_back(xf.origin.x());
+  origin_y.push_back(xf.origin.y());
+  scale_x.push_back(xf.scale.x());
+  scale_y.push_back(xf.scale.y());
+  pivot_x.push_back(xf.pivot.x());
+  pivot_y.push_back(xf.pivot.y());
+  cos_a.push_back(xf.rotation.x());
+  sin_a.push_back(xf.rotation.y());
+  z.push_back(xf.z);
+  co_x0.push_back(co0.x());
+  co_y0.push_back(co0.y());
+  co_x1.push_back(co1.x());
+  co_y1.push_back(co1.y());
+  uv_x0.push_back(uv0.x());
+  uv_y0.push_back(uv0.y());
+  uv_x1.push_back(uv1.x());
+  uv_y1.push_back(uv1.y());
+  color.push_back(rgba);
+}
+
+void SpriteBatch::Quads::Clear() {
+  origin_x.clear();
+  origin_y.clear();
+  scale_x.clear();
+  scale_y.clear();
+  pivot_x.clear();
+  pivot_y.clear();
+  cos_a.clear();
+  sin_a.clear();
+  z.clear();
+  co_x0.clear();
+  co_y0.clear();
+  co_x1.clear();
+  co_y1.clear();
+  uv_x0.clear();
+  uv_y0.clear();
+  uv_x1.clear();
+  uv_y1.clear();
+  color.clear();
+}
+
+void SpriteBatch::TransformScalar(const Quads& q, int first, int count,
+                                  Vertex* out) {
+  for (int i = first; i < first + count; ++i, out += 4) {
+    float base_x = q.origin_x[i] + q.pivot_x[i];
+    float base_y = q.origin_y[i] + q.pivot_y[i];
+    float lx[2] = { q.co_x0[i] * q.scale_x[i] - q.pivot_x[i],
+                    q.co_x1[i] * q.scale_x[i] - q.pivot_x[i] };
+    float ly[2] = { q.co_y0[i] * q.scale_y[i] - q.pivot_y[i],
+                    q.co_y1[i] * q.scale_y[i] - q.pivot_y[i] };
+    const int corner_x[4] = { 0, 0, 1, 1 }, corner_y[4] = { 0, 1, 1, 0 };
+    float x[4], y[4];
+    for (int j = 0; j < 4; ++j) {
+      float cx = lx[corner_x[j]], cy = ly[corner_y[j]];
+      x[j] = base_x + cx * q.cos_a[i] - cy * q.sin_a[i];
+      y[j] = base_y + cx * q.sin_a[i] + cy * q.cos_a[i];
+    }
+    Emit(q, i, x, y, out);
+  }
+}
+
+void SpriteBatch::Transform(const Quads& q, int first, int count,
+                            Vertex* out) {
+  int i = first, end = first + count;
+#if defined(__AVX2__) || defined(__SSE2__)
+  for (; i + SIMD_WIDTH <= end; i += SIMD_WIDTH, out += 4 * SIMD_WIDTH) {
+    Floats c = LoadF(&q.cos_a[i]), s = LoadF(&q.sin_a[i]);
+    Floats px = LoadF(&q.pivot_x[i]), py = LoadF(&q.pivot_y[i]);
+    Floats sx = LoadF(&q.scale_x[i]), sy = LoadF(&q.scale_y[i]);
+    Floats base_x = AddF(LoadF(&q.origin_x[i]), px);
+    Floats base_y = AddF(LoadF(&q.origin_y[i]), py);
+    Floats lx[2] = { SubF(MulF(LoadF(&q.co_x0[i]), sx), px),
+                     SubF(MulF(LoadF(&q.co_x1[i]), sx), px) };
+    Floats ly[2] = { SubF(MulF(LoadF(&q.co_y0[i]), sy), py),
+                     SubF(MulF(LoadF(&q.co_y1[i]), sy), py) };
+
+    // Rotate and translate each corner for all lanes
+    const int corner_x[4] = { 0, 0, 1, 1 }, corner_y[4] = { 0, 1, 1, 0 };
+    float x[4][SIMD_WIDTH], y[4][SIMD_WIDTH];
+    for (int j = 0; j < 4; ++j) {
+      Floats cx = lx[corner_x[j]], cy = ly[corner_y[j]];
+      StoreF(x[j], AddF(base_x, SubF(MulF(cx, c), MulF(cy, s))));
+      StoreF(y[j], AddF(base_y, AddF(MulF(cx, s), MulF(cy, c))));
+    }
+
+    // Interleave lanes into vertices
+    for (int k = 0; k < SIMD_WIDTH; ++k) {
+      float qx[4] = { x[0][k], x[1][k], x[2][k], x[3][k] };
+      float qy[4] = { y[0][k], y[1][k], y[2][k], y[3][k] };
+      Emit(q, i + k, qx, qy, out + 4 * k);
+    }
+  }
+#endif
+  TransformScalar(q, i, end - i, out);
+}
+
+void SpriteBatch::Add(const State& state, const Sprite::Transform& xf,
+                      Vec<2> co0, Vec<2> co1, Vec<2> uv0, Vec<2> uv1,
+                      Color color) {
+
+  // Convert modulation color to bytes
+  unsigned char rgba[4];
+  for (int i = 0; i < 4; ++i) {
+    float c = color[i];
+    math::Limit(c, 0.f, 1.f);
+    rgba[i] = (unsigned char)(255 * c + 0.5f);
+  }
+  unsigned int packed;
+  memcpy(&packed, rgba, sizeof (packed));
+
+  // Packed textures are drawn from their atlas page
+  Quad quad;
+  quad.state = state;
+  if (state.texture && state.texture->page() != state.texture) {
+    uv0 = state.texture->PageUV(uv0);
+    uv1 = state.texture->PageUV(uv1);
+    quad.state.texture = state.texture->page();
+  }
+
+  // Record the quad, vertices are generated when the batch is flushed
+  quad.z = xf.z;
+  quad.index = soa$.size() * 4;
+  quads$.push_back(quad);
+  Sprite::Transform offset_xf = xf;
+  offset_xf.origin += offset$;
+  soa$.Add(offset_xf, co0, co1, uv0, uv1, packed);
+}
+
+bool SpriteBatch::Compare(const Quad& a, const Quad& b) {
+  if (a.z != b.z)
+    return a.z > b.z;
+  if (!(a.state == b.state))
+    return a.state < b.state;
+  return a.index < b.index;
+}
+
+void SpriteBatch::Flush() {
+  if (quads$.empty())
+    return;
+
+  // Transform all quads into vertices
+  vertices$.resize(soa$.size() * 4);
+  Transform(soa$, 0, soa$.size(), &vertices$[0]);
+
+  // Sort quads and build the index list in render order
+  std::sort(quads$.begin(), quads$.end(), Compare);
+  indices$.clear();
+  for (int i = 0; i < (int)quads$.size(); ++i)
+    for (int j = 0; j < 4; ++j)
+      indices$.push_back(quads$[i].index + j);
+
+  // Render each run of quads that share a render state
+  glInterleavedArrays(Vertex::FORMAT, 0, &vertices$[0]);
+  for (int start = 0, end; start < (int)quads$.size(); start = end) {
+    const State& state = quads$[start].state;
+    for (end = start + 1; end < (int)quads$.size() &&
+                          quads$[end].state == state; ++end);
+
+    // Select texture
+    if (state.texture)
+      state.texture->Select(state.smooth);
+    else
+      Texture::Deselect();
+
+    // Additive blending
+    if (state.blend == Sprite::Data::BLEND_ADD) {
+      Mode::Enable(GL_BLEND);
+      Mode::Disable(GL_ALPHA_TEST);
+      Mode::BlendFunc(GL_SRC_ALPHA, GL_ONE);
+    }
+
+    // Solid color
+    else if (state.blend == Sprite::Data::BLEND_SOLID) {
+      Mode::Disable(GL_BLEND);
+      Mode::Disable(GL_ALPHA_TEST);
+    }
+
+    // Distance fields are filtered smoothly and cut off at the edge
+    else if (state.blend == Sprite::Data::BLEND_DISTANCE) {
+      Mode::Enable(GL_BLEND);
+      Mode::Enable(GL_ALPHA_TEST);
+      Mode::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      Mode::AlphaFunc(GL_GEQUAL, 0.5f);
+      if (state.texture)
+        Mode::TextureFilters(GL_LINEAR, GL_LINEAR);
+    }
+
+    // Alpha blending
+    else {
+      Mode::Enable(GL_BLEND);
+      Mode::Enable(GL_ALPHA_TEST);
+      Mode::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+      Mode::AlphaFunc(GL_GREATER, 1 / 255.f);
+    }
+
+    // Render the run
+    glDrawElements(GL_QUADS, (end - start) * 4, GL_UNSIGNED_INT,
+                   &indices$[start * 4]);
+    if (CHECKED) {
+      Mode::faces$ += (end - start) * 2;
+      ++Mode::calls$;
+    }
+  }
+
+  // Code drawing outside the batch expects the default alpha test
+  Mode::AlphaFunc(GL_GREATER, 1 / 255.f);
+
+  // Buffers keep their capacity for the next frame
+  soa$.Clear();
+  quads$.clear();
+  Mode::Check();
+}
+
+void SpriteBatch::PushOffset(Vec<2> offset) {
+  offsets$.push_back(offset$);
+  offset$ += offset;
+}
+
+void SpriteBatch::PopOffset() {
+  ASSERT(!offsets$.empty());
+  offset$ = offsets$.back();
+  offsets$.pop_back();
+}
+
+} // namespace dragoon
@@ -0,0 +1,133 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+#include "Sprite.h"
+
+namespace dragoon {
+
+/** Static class that collects transformed sprite quads during a frame and
+    renders them with as few draw calls as possible. Quads are sorted back to
+    front and then by render state, and each run of quads sharing a state is
+    drawn with a single call. */
+class SpriteBatch {
+public:
+
+  /** Batched vertex, carries its own modulation color */
+#pragma pack(push, 4)
+  struct Vertex {
+    enum { FORMAT = GL_T2F_C4UB_V3F };
+
+    Vec<2> uv;
+    unsigned char color[4];
+    Vec<2> co;
+    float z;
+  };
+#pragma pack(pop)
+
+  /** Render state shared by a run of quads */
+  struct State {
+    State(Texture* texture = NULL, Sprite::Data::Blend blend =
+          Sprite::Data::BLEND_ALPHA, bool smooth = false):
+      texture(texture), blend(blend), smooth(smooth) {}
+
+    bool operator<(const State& s) const {
+      if (texture != s.texture)
+        return texture < s.texture;
+      if (blend != s.blend)
+        return blend < s.blend;
+      return smooth < s.smooth;
+    }
+
+    bool operator==(const State& s) const {
+      return texture == s.texture && blend == s.blend && smooth == s.smooth;
+    }
+
+    Texture* texture;
+    Sprite::Data::Blend blend;
+    bool smooth;
+  };
+
+  /** Structure-of-arrays list of quads consumed by the transform kernel.
+      Each quad is a rectangle in unit quad space with its own texture
+      rectangle and sprite transform. */
+  struct Quads {
+
+    /** Append a quad */
+    void Add(const Sprite::Transform& xf, Vec<2> co0, Vec<2> co1,
+             Vec<2> uv0, Vec<2> uv1, unsigned int color);
+
+    /** Remove all quads, keeping allocated memory */
+    void Clear();
+
+    /** Number of quads */
+    int size() const { return z.size(); }
+
+    std::vector<float> origin_x, origin_y, scale_x, scale_y, pivot_x, pivot_y,
+                       cos_a, sin_a, z, co_x0, co_y0, co_x1, co_y1,
+                       uv_x0, uv_y0, uv_x1, uv_y1;
+    std::vector<unsigned int> color;
+  };
+
+  /** Transform a range of quads into four interleaved vertices each. Uses
+      the widest vector instruction set the build targets. */
+  static void Transform(const Quads&, int first, int count, Vertex* out);
+
+  /** Add a quad to the batch.
+   *  @param state  Texture and blending for the quad
+   *  @param xf     Transform applied to the quad corners
+   *  @param co0    Top-left corner in unit quad space
+   *  @param co1    Bottom-right corner in unit quad space
+   *  @param uv0    Texture coordinate at \c co0
+   *  @param uv1    Texture coordinate at \c co1
+   *  @param color  Modulation color
+   */
+  static void Add(const State& state, const Sprite::Transform& xf,
+                  Vec<2> co0, Vec<2> co1, Vec<2> uv0, Vec<2> uv1,
+                  Color color);
+
+  /** Render and clear all batched quads. Must be called before any
+      unbatched drawing that depends on the order of rendering. */
+  static void Flush();
+
+  /** Offset all quads added until the matching PopOffset() */
+  static void PushOffset(Vec<2> offset);
+
+  /** Restore offset saved by PushOffset() */
+  static void PopOffset();
+
+private:
+  SpriteBatch() {}
+
+  /** Batched quad record */
+  struct Quad {
+    State state;
+    float z;
+    int index;
+  };
+
+  /** Scalar kernel for quads the vector kernel does not cover */
+  static void TransformScalar(const Quads&, int first, int count,
+                              Vertex* out);
+
+  /** Back-to-front, then by render state, in order of submission */
+  static bool Compare(const Quad& a, const Quad& b);
+
+  static Quads soa$;
+  static std::vector<Vertex> vertices$;
+  static std::vector<Quad> quads$;
+  static std::vector<unsigned int> indices$;
+  static std::vector<Vec<2> > offsets$;
+  static Vec<2> offset$;
+};
+
+} // namespace dragoon
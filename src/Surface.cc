@@ -11,12 +11,139 @@
 \******************************************************************************/
 
 #include "log.h"
+#include "math.h"
 #include "os.h"
 #include "Mode.h"
+#include "SpriteBatch.h"
 #include "Surface.h"
 
 namespace dragoon {
 
+namespace {
+
+  // Split a raw 32-bit pixel into 8-bit channels
+  inline void Unpack(Uint32 pixel, const SDL_PixelFormat* f, int c[4]) {
+    c[0] = (pixel >> f->Rshift) & 0xff;
+    c[1] = (pixel >> f->Gshift) & 0xff;
+    c[2] = (pixel >> f->Bshift) & 0xff;
+    c[3] = (pixel >> f->Ashift) & 0xff;
+  }
+
+  // Combine 8-bit channels into a raw 32-bit pixel
+  inline Uint32 Pack(const int c[4], const SDL_PixelFormat* f) {
+    return (Uint32)c[0] << f->Rshift | (Uint32)c[1] << f->Gshift |
+           (Uint32)c[2] << f->Bshift | (Uint32)c[3] << f->Ashift;
+  }
+
+  // Convert a raw pixel between two raw formats
+  inline Uint32 Convert(Uint32 pixel, const SDL_PixelFormat* from,
+                        const SDL_PixelFormat* to) {
+    int c[4];
+    Unpack(pixel, from, c);
+    return Pack(c, to);
+  }
+
+  // Raw cache file identification
+  const char RAW_MAGIC[4] = { 'D', 'R', 'A', 'W' };
+  const int RAW_VERSION = 1;
+
+  // Header of a raw cache file, followed by the stamp and then the pixels
+  struct RawHeader {
+    char magic[4];
+    int version;
+    int stamp_length;
+    int width;
+    int height;
+    Uint32 mask[4];
+  };
+
+  // Returns true if two raw formats have the same channel layout
+  inline bool SameFormat(const SDL_PixelFormat* a, const SDL_PixelFormat* b) {
+    return a->Rmask == b->Rmask && a->Gmask == b->Gmask &&
+           a->Bmask == b->Bmask && a->Amask == b->Amask;
+  }
+
+  // Channel value as returned by Surface::Get()
+  inline float Unit(Uint32 pixel, int shift) {
+    return ((pixel >> shift) & 0xff) / 255.f;
+  }
+
+  // Deseam a single raw pixel. The operations and their order match the
+  // generic Color path exactly so the results are bit-identical.
+  inline void DeseamPixel(const Uint32* up, const Uint32* row,
+                          const Uint32* down, const SDL_PixelFormat* f,
+                          Uint32* dest) {
+    if ((*row >> f->Ashift) & 0xff)
+      return;
+    const Uint32 neighbors[4] = { row[-1], *up, row[1], *down };
+    const int shift[3] = { f->Rshift, f->Gshift, f->Bshift };
+    float sum[3] = { 0, 0, 0 }, sum_a = 1;
+    for (int i = 0; i < 4; ++i) {
+      float a = Unit(neighbors[i], f->Ashift);
+      for (int j = 0; j < 3; ++j)
+        sum[j] += Unit(neighbors[i], shift[j]) * a;
+      sum_a += a * a;
+    }
+    Uint32 pixel = 0;
+    for (int j = 0; j < 3; ++j)
+      pixel |= (Uint32)(Uint8)(255 * (sum[j] / sum_a)) << shift[j];
+    *dest = pixel;
+  }
+
+#if defined(__SSE2__)
+  // Channel values of four raw pixels
+  inline __m128 UnitQuad(__m128i pixels, int shift) {
+    __m128i c = _mm_and_si128(_mm_srl_epi32(pixels, _mm_cvtsi32_si128(shift)),
+                              _mm_set1_epi32(0xff));
+    return _mm_div_ps(_mm_cvtepi32_ps(c), _mm_set1_ps(255.f));
+  }
+
+  // Deseam four adjacent raw pixels, same arithmetic as DeseamPixel()
+  inline void DeseamQuad(const Uint32* up, const Uint32* row,
+                         const Uint32* down, const SDL_PixelFormat* f,
+                         Uint32* dest) {
+
+    // Skip runs without transparent pixels
+    __m128i center = _mm_loadu_si128((const __m128i*)row);
+    __m128i alpha = _mm_and_si128(_mm_srl_epi32(center,
+                                                _mm_cvtsi32_si128(f->Ashift)),
+                                  _mm_set1_epi32(0xff));
+    __m128i clear = _mm_cmpeq_epi32(alpha, _mm_setzero_si128());
+    if (!_mm_movemask_epi8(clear))
+      return;
+
+    // Weighted sum of the neighbors
+    const __m128i neighbors[4] = {
+      _mm_loadu_si128((const __m128i*)(row - 1)),
+      _mm_loadu_si128((const __m128i*)up),
+      _mm_loadu_si128((const __m128i*)(row + 1)),
+      _mm_loadu_si128((const __m128i*)down),
+    };
+    const int shift[3] = { f->Rshift, f->Gshift, f->Bshift };
+    __m128 sum[3] = { _mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps() };
+    __m128 sum_a = _mm_set1_ps(1);
+    for (int i = 0; i < 4; ++i) {
+      __m128 a = UnitQuad(neighbors[i], f->Ashift);
+      for (int j = 0; j < 3; ++j)
+        sum[j] = _mm_add_ps(sum[j],
+                            _mm_mul_ps(UnitQuad(neighbors[i], shift[j]), a));
+      sum_a = _mm_add_ps(sum_a, _mm_mul_ps(a, a));
+    }
+
+    // Normalize, truncate to bytes, and write only the transparent pixels
+    __m128i pixels = _mm_setzero_si128();
+    for (int j = 0; j < 3; ++j) {
+      __m128 c = _mm_mul_ps(_mm_set1_ps(255.f), _mm_div_ps(sum[j], sum_a));
+      pixels = _mm_or_si128(pixels, _mm_sll_epi32(_mm_cvttps_epi32(c),
+                                                  _mm_cvtsi32_si128(shift[j])));
+    }
+    pixels = _mm_or_si128(_mm_and_si128(clear, pixels),
+                          _mm_andnot_si128(clear, center));
+    _mm_storeu_si128((__m128i*)dest, pixels);
+  }
+#endif
+}
+
 Surface::Surface(const char* filename): lock_(0) {
   FILE* file = os::OpenRead(filename);
   if (!file)
@@ -119,6 +246,7 @@ Surface::Surface(const char* filename): lock_(0) {
 }
 
 Surface::Surface(int x, int y, int w, int h) {
+  SpriteBatch::Flush();
   Alloc(w, h);
   Lock();
   glReadPixels(x, Mode::height() - h - y, w, h,
@@ -159,6 +287,7 @@ void Surface::Put(int x, int y, Color color) {
   default:
     ERROR("Invalid surface format");
   }
+  Dirty(x, y, 1, 1);
 }
 
 Color Surface::Get(int x, int y) const {
@@ -290,8 +419,85 @@ bool Surface::Save(const char *filename) {
   return success;
 }
 
+bool Surface::SaveRaw(const char* filename, const std::string& stamp) {
+  if (!ptr_ || !Raw() || !Lock())
+    return false;
+
+  // Write to a temporary file first so a partial file is never loaded
+  std::string temp_name = std::string(filename) + ".tmp";
+  FILE* file = os::OpenWrite(temp_name.c_str());
+  bool success = false;
+  if (file) {
+    RawHeader header;
+    memcpy(header.magic, RAW_MAGIC, sizeof (header.magic));
+    header.version = RAW_VERSION;
+    header.stamp_length = stamp.size();
+    header.width = ptr_->w;
+    header.height = ptr_->h;
+    header.mask[0] = ptr_->format->Rmask;
+    header.mask[1] = ptr_->format->Gmask;
+    header.mask[2] = ptr_->format->Bmask;
+    header.mask[3] = ptr_->format->Amask;
+    success = fwrite(&header, sizeof (header), 1, file) == 1 &&
+              fwrite(stamp.data(), 1, stamp.size(), file) == stamp.size();
+    for (int y = 0; success && y < ptr_->h; ++y)
+      success = fwrite(Row(y), sizeof (Uint32), ptr_->w, file) ==
+                (size_t)ptr_->w;
+    success = !fclose(file) && success;
+    success = success && !rename(temp_name.c_str(), filename);
+    if (!success)
+      remove(temp_name.c_str());
+  }
+  Unlock();
+  return success;
+}
+
+bool Surface::LoadRaw(const char* filename, const std::string& stamp) {
+  size_t size;
+  const Uint8* data = (const Uint8*)os::MapFile(filename, size);
+  if (!data)
+    return false;
+
+  // Check that the file is complete and was made from the same source
+  bool success = false;
+  RawHeader header;
+  if (size >= sizeof (header)) {
+    memcpy(&header, data, sizeof (header));
+    const Uint8* pixels = data + sizeof (header) + stamp.size();
+    success = !memcmp(header.magic, RAW_MAGIC, sizeof (header.magic)) &&
+              header.version == RAW_VERSION &&
+              header.stamp_length == (int)stamp.size() &&
+              header.width > 0 && header.height > 0 &&
+              size == sizeof (header) + stamp.size() +
+                      (size_t)header.width * header.height * sizeof (Uint32) &&
+              !memcmp(data + sizeof (header), stamp.data(), stamp.size());
+
+    // Copy the pixels if they are in our format
+    if (success) {
+      Alloc(header.width, header.height);
+      success = ptr_->format->Rmask == header.mask[0] &&
+                ptr_->format->Gmask == header.mask[1] &&
+                ptr_->format->Bmask == header.mask[2] &&
+                ptr_->format->Amask == header.mask[3] && Lock();
+      if (success) {
+        for (int y = 0; y < header.height; ++y)
+          memcpy(Row(y), pixels + y * header.width * sizeof (Uint32),
+                 header.width * sizeof (Uint32));
+        Unlock();
+      } else
+        Release();
+    }
+  }
+  os::UnmapFile(data, size);
+  return success;
+}
+
 void Surface::Deseam() {
-  if (Lock()) {
+  if (!Lock())
+    return;
+
+  // Generic per-pixel path
+  if (!Raw()) {
     for (int y = 0; y < ptr_->h; ++y)
       for (int x = 0; x < ptr_->w; ++x) {
         Color color = Get(x, y);
@@ -321,18 +527,55 @@ void Surface::Deseam() {
         }
       }
     Unlock();
+    return;
+  }
+
+  // Rows are copied with a transparent pixel on either side so that missing
+  // neighbors contribute nothing, just like skipped neighbors. Pixels that
+  // get colored in keep zero alpha, so reading the original rows gives the
+  // same result as reading them back in place.
+  int w = ptr_->w;
+  std::vector<Uint32> rows[3];
+  for (int i = 0; i < 3; ++i)
+    rows[i].assign(w + 2, 0);
+  Uint32 *up = &rows[0][1], *row = &rows[1][1], *down = &rows[2][1];
+  memcpy(row, Row(0), w * sizeof (Uint32));
+  for (int y = 0; y < ptr_->h; ++y) {
+    if (y < ptr_->h - 1)
+      memcpy(down, Row(y + 1), w * sizeof (Uint32));
+    else
+      memset(down, 0, w * sizeof (Uint32));
+    Uint32* dest = Row(y);
+    int x = 0;
+#if defined(__SSE2__)
+    for (; x + 4 <= w; x += 4)
+      DeseamQuad(up + x, row + x, down + x, ptr_->format, dest + x);
+#endif
+    for (; x < w; ++x)
+      DeseamPixel(up + x, row + x, down + x, ptr_->format, dest + x);
+    Uint32* swap = up;
+    up = row;
+    row = down;
+    down = swap;
   }
+  Dirty(0, 0, ptr_->w, ptr_->h);
+  Unlock();
 }
 
 void Surface::Flip() {
   if (Lock()) {
-    for (int y = 0; y < ptr_->h / 2; y++)
-      for (int x = 0; x < ptr_->w; x++) {
-        Color color_top = Get(x, y);
-        Color color_bottom = Get(x, ptr_->h - y - 1);
-        Put(x, y, color_bottom);
-        Put(x, ptr_->h - y - 1, color_top);
-      }
+
+    // Swapping rows works for any pixel format
+    int bytes = ptr_->w * ptr_->format->BytesPerPixel;
+    std::vector<Uint8> buf(bytes);
+    for (int y = 0; y < ptr_->h / 2; y++) {
+      Uint8* top = (Uint8*)ptr_->pixels + y * ptr_->pitch;
+      Uint8* bottom = (Uint8*)ptr_->pixels + (ptr_->h - y - 1) * ptr_->pitch;
+      memcpy(&buf[0], top, bytes);
+      memcpy(top, bottom, bytes);
+      memcpy(bottom, &buf[0], bytes);
+    }
+    Dirty(0, 0, ptr_->w, ptr_->h);
     Unlock();
   }
 }
@@ -340,13 +583,39 @@ void Surface::Flip() {
 void Surface::Scale(Surface& dest, int scale_x, int scale_y, int dx, int dy) {
   if (Lock()) {
     if (dest.Lock()) {
-      for (int y = 0; y < ptr_->h; y++)
-        for (int x = 0; x < ptr_->w; x++) {
-          Color color = Get(x, y);
-          for (int ys = 0; ys < scale_y; ys++)
+
+      // Replicate pixels across a row and then copy the row down
+      if (Raw() && dest.Raw()) {
+        ASSERT(dx >= 0 && dy >= 0 && dx + ptr_->w * scale_x <= dest->w &&
+               dy + ptr_->h * scale_y <= dest->h);
+        bool same = SameFormat(ptr_->format, dest->format);
+        for (int y = 0; y < ptr_->h; y++) {
+          const Uint32* src = Row(y);
+          Uint32* first = dest.Row(dy + scale_y * y) + dx;
+          Uint32* dst = first;
+          for (int x = 0; x < ptr_->w; x++) {
+            Uint32 pixel = same ? src[x] : Convert(src[x], ptr_->format,
+                                                   dest->format);
             for (int xs = 0; xs < scale_x; xs++)
-              dest.Put(dx + scale_x * x + xs, dy + scale_y * y + ys, color);
+              *dst++ = pixel;
+          }
+          for (int ys = 1; ys < scale_y; ys++)
+            memcpy(dest.Row(dy + scale_y * y + ys) + dx, first,
+                   ptr_->w * scale_x * sizeof (Uint32));
         }
+      }
+
+      // Generic per-pixel path
+      else
+        for (int y = 0; y < ptr_->h; y++)
+          for (int x = 0; x < ptr_->w; x++) {
+            Color color = Get(x, y);
+            for (int ys = 0; ys < scale_y; ys++)
+              for (int xs = 0; xs < scale_x; xs++)
+                dest.Put(dx + scale_x * x + xs, dy + scale_y * y + ys, color);
+          }
+
+      dest.Dirty(dx, dy, ptr_->w * scale_x, ptr_->h * scale_y);
       dest.Unlock();
     }
     Unlock();
@@ -357,9 +626,30 @@ void Surface::Blit(Surface& dest, int sx, int sy, int sw, int sh,
                    int dx, int dy) {
   if (Lock()) {
     if (dest.Lock()) {
-      for (int y = 0; y < sh; y++)
-        for (int x = 0; x < sw; x++)
-          dest.Put(dx + x, dy + y, Get(sx + x, sy + y));
+
+      // Copy whole rows
+      if (Raw() && dest.Raw()) {
+        ASSERT(sx >= 0 && sy >= 0 && sx + sw <= ptr_->w && sy + sh <= ptr_->h);
+        ASSERT(dx >= 0 && dy >= 0 && dx + sw <= dest->w && dy + sh <= dest->h);
+        bool same = SameFormat(ptr_->format, dest->format);
+        for (int y = 0; y < sh; y++) {
+          const Uint32* src = Row(sy + y) + sx;
+          Uint32* dst = dest.Row(dy + y) + dx;
+          if (same)
+            memmove(dst, src, sw * sizeof (Uint32));
+          else
+            for (int x = 0; x < sw; x++)
+              dst[x] = Convert(src[x], ptr_->format, dest->format);
+        }
+      }
+
+      // Generic per-pixel path
+      else
+        for (int y = 0; y < sh; y++)
+          for (int x = 0; x < sw; x++)
+            dest.Put(dx + x, dy + y, Get(sx + x, sy + y));
+
+      dest.Dirty(dx, dy, sw, sh);
       dest.Unlock();
     }
     Unlock();
@@ -370,9 +660,30 @@ void Surface::Blit(Surface& dest, int sx, int sy, int sw, int sh,
                    int dx, int dy, int dw, int dh) {
   if (Lock()) {
     if (dest.Lock()) {
-      for (int y = 0; y < dh; y++)
-        for (int x = 0; x < dw; x++)
-          dest.Put(dx + x, dy + y, Get(sx + x * sw / dw, sy + y * sh / dh));
+
+      // Nearest-neighbor resampling on rows
+      if (Raw() && dest.Raw()) {
+        ASSERT(sx >= 0 && sy >= 0 && sx + sw <= ptr_->w && sy + sh <= ptr_->h);
+        ASSERT(dx >= 0 && dy >= 0 && dx + dw <= dest->w && dy + dh <= dest->h);
+        bool same = SameFormat(ptr_->format, dest->format);
+        for (int y = 0; y < dh; y++) {
+          const Uint32* src = Row(sy + y * sh / dh) + sx;
+          Uint32* dst = dest.Row(dy + y) + dx;
+          for (int x = 0; x < dw; x++) {
+            Uint32 pixel = src[x * sw / dw];
+            dst[x] = same ? pixel : Convert(pixel, ptr_->format,
+                                            dest->format);
+          }
+        }
+      }
+
+      // Generic per-pixel path
+      else
+        for (int y = 0; y < dh; y++)
+          for (int x = 0; x < dw; x++)
+            dest.Put(dx + x, dy + y, Get(sx + x * sw / dw, sy + y * sh / dh));
+
+      dest.Dirty(dx, dy, dw, dh);
       dest.Unlock();
     }
     Unlock();
@@ -384,14 +695,54 @@ void Surface::BlitShadowed(Surface& dest, int sx, int sy, int sw, int sh,
   ASSERT(sh_x >= 0 && sh_y >= 0);
   if (Lock()) {
     if (dest.Lock()) {
-      for (int y = 0; y < sh; y++)
-        for (int x = 0; x < sw; x++) {
-          Color sc = Get(sx + x, sy + y);
-          Color sh = Color::none();
-          if (x > sh_x && y > sh_y)
-            sh = Get(sx + x - sh_x, sy + y - sh_y) * shadow;
-          dest.Put(dx + x, dy + y, sc.Blend(sh));
+
+      // Blend in fixed point, alpha and weights are scaled by 255 * 255
+      if (Raw() && dest.Raw()) {
+        ASSERT(sx >= 0 && sy >= 0 && sx + sw <= ptr_->w && sy + sh <= ptr_->h);
+        ASSERT(dx >= 0 && dy >= 0 && dx + sw <= dest->w && dy + sh <= dest->h);
+        int shadow_c[4];
+        for (int i = 0; i < 4; i++) {
+          float c = shadow[i];
+          math::Limit(c, 0.f, 1.f);
+          shadow_c[i] = (int)(c * 255 + 0.5f);
+        }
+        for (int y = 0; y < sh; y++) {
+          const Uint32* src = Row(sy + y) + sx;
+          const Uint32* src_sh = y > sh_y ? Row(sy + y - sh_y) + sx - sh_x
+                                          : NULL;
+          Uint32* dst = dest.Row(dy + y) + dx;
+          for (int x = 0; x < sw; x++) {
+            int sc[4], shc[4] = { 0, 0, 0, 0 }, out[4] = { 0, 0, 0, 0 };
+            Unpack(src[x], ptr_->format, sc);
+            if (x > sh_x && y > sh_y) {
+              Unpack(src_sh[x], ptr_->format, shc);
+              for (int i = 0; i < 4; i++)
+                shc[i] = shc[i] * shadow_c[i] / 255;
+            }
+            int w = (255 - sc[3]) * shc[3];
+            int a = sc[3] * 255 + w;
+            if (a) {
+              for (int i = 0; i < 3; i++)
+                out[i] = (sc[i] * sc[3] * 255 + w * shc[i] + a / 2) / a;
+              out[3] = (a + 127) / 255;
+            }
+            dst[x] = Pack(out, dest->format);
+          }
         }
+      }
+
+      // Generic per-pixel path
+      else
+        for (int y = 0; y < sh; y++)
+          for (int x = 0; x < sw; x++) {
+            Color sc = Get(sx + x, sy + y);
+            Color sh = Color::none();
+            if (x > sh_x && y > sh_y)
+              sh = Get(sx + x - sh_x, sy + y - sh_y) * shadow;
+            dest.Put(dx + x, dy + y, sc.Blend(sh));
+          }
+
+      dest.Dirty(dx, dy, sw, sh);
       dest.Unlock();
     }
     Unlock();
@@ -416,6 +767,87 @@ void Surface::Alloc(int width, int height) {
                               mask[0], mask[1], mask[2], mask[3]);
   SDL_SetAlpha(ptr_, SDL_RLEACCEL, SDL_ALPHA_OPAQUE);
   ASSERT(ptr_->format);
+  dirty_.clear();
+  Dirty(0, 0, width, height);
+}
+
+void Surface::Clear(int x, int y, int w, int h) {
+  if (!ptr_)
+    return;
+  SDL_Rect rect = { (Sint16)x, (Sint16)y, (Uint16)w, (Uint16)h };
+  SDL_FillRect(ptr_, &rect, 0);
+  Dirty(x, y, w, h);
+}
+
+void Surface::Dirty(int x, int y, int w, int h) {
+  if (!ptr_)
+    return;
+
+  // Clip to the surface
+  if (x < 0) {
+    w += x;
+    x = 0;
+  }
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (x + w > ptr_->w)
+    w = ptr_->w - x;
+  if (y + h > ptr_->h)
+    h = ptr_->h - y;
+  if (w <= 0 || h <= 0)
+    return;
+
+  // Already covered by the last change, common when putting pixels
+  if (!dirty_.empty()) {
+    const Rect& last = dirty_.back();
+    if (x >= last.x && y >= last.y && x + w <= last.x + last.w &&
+        y + h <= last.y + last.h)
+      return;
+  }
+
+  // Merge with any rectangles the new one touches until none are left
+  Rect rect(x, y, w, h);
+  for (int i = 0; i < (int)dirty_.size(); ) {
+    const Rect& r = dirty_[i];
+    if (rect.x > r.x + r.w || r.x > rect.x + rect.w ||
+        rect.y > r.y + r.h || r.y > rect.y + rect.h) {
+      ++i;
+      continue;
+    }
+    int x1 = std::max(rect.x + rect.w, r.x + r.w);
+    int y1 = std::max(rect.y + rect.h, r.y + r.h);
+    rect.x = std::min(rect.x, r.x);
+    rect.y = std::min(rect.y, r.y);
+    rect.w = x1 - rect.x;
+    rect.h = y1 - rect.y;
+    dirty_.erase(dirty_.begin() + i);
+    i = 0;
+  }
+  dirty_.push_back(rect);
+
+  // Too many separate changes are collapsed into their bounding box
+  if ((int)dirty_.size() > DIRTY_MAX) {
+    int x1 = 0, y1 = 0;
+    rect = dirty_[0];
+    for (int i = 0; i < (int)dirty_.size(); ++i) {
+      x1 = std::max(x1, dirty_[i].x + dirty_[i].w);
+      y1 = std::max(y1, dirty_[i].y + dirty_[i].h);
+      rect.x = std::min(rect.x, dirty_[i].x);
+      rect.y = std::min(rect.y, dirty_[i].y);
+    }
+    rect.w = x1 - rect.x;
+    rect.h = y1 - rect.y;
+    dirty_.clear();
+    dirty_.push_back(rect);
+  }
+}
+
+bool Surface::Raw() const {
+  const SDL_PixelFormat* f = ptr_ ? ptr_->format : NULL;
+  return f && f->BytesPerPixel == 4 && f->Amask &&
+         !f->Rloss && !f->Gloss && !f->Bloss && !f->Aloss;
 }
 
 void Surface::Validate(int x, int y) const {
@@ -10,6 +10,7 @@
  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
 \******************************************************************************/
 
+#pragma once
 #include "ptr.h"
 #include "Vec.h"
 
@@ -37,6 +38,9 @@ public:
   /** Set a pixel on the surface to a specific color */
   void Put(int x, int y, Color color);
 
+  /** Clear a rectangle of the surface to transparent black */
+  void Clear(int x, int y, int w, int h);
+
   /** Get the color value of a pixel on the surface */
   Color Get(int x, int y) const;
 
@@ -53,8 +57,22 @@ public:
    */
   bool Save(const char* filename);
 
+  /** Write the raw pixels of the surface to a cache file
+   *  @param filename  Cache file to write
+   *  @param stamp     Identifies the source of the pixels, a later LoadRaw()
+   *                   only succeeds with the same stamp
+   *  @returns true if a file was written
+   */
+  bool SaveRaw(const char* filename, const std::string& stamp);
+
+  /** Load pixels written by SaveRaw() by mapping the file into memory
+   *  @returns true if the file was valid and had a matching stamp
+   */
+  bool LoadRaw(const char* filename, const std::string& stamp);
+
   /** Scan a surface and color in transparent pixel colors with the average
-      of their neighbors to prevent seam glitches during rotation */
+      of their neighbors to prevent seam glitches during rotation. Raw
+      surfaces are processed a row at a time. */
   void Deseam();
 
   /** Vertically flip surface pixels */
@@ -74,6 +92,32 @@ public:
   void BlitShadowed(Surface& dest, int sx, int sy, int sw, int sh,
                     int dx, int dy, int sh_x, int sh_y, Color shadow);
 
+  /** Exchange surface pointers with another unlocked surface */
+  void Swap(Surface& other) {
+    std::swap(ptr_, other.ptr_);
+    dirty_.swap(other.dirty_);
+  }
+
+  /** Rectangle of pixels on a surface */
+  struct Rect {
+    Rect(int x, int y, int w, int h): x(x), y(y), w(w), h(h) {}
+
+    int x;
+    int y;
+    int w;
+    int h;
+  };
+
+  /** Mark a region of the surface as changed. Put() and blits onto the
+      surface do this automatically. */
+  void Dirty(int x, int y, int w, int h);
+
+  /** Regions changed since the last call to Clean() */
+  const std::vector<Rect>& dirty() const { return dirty_; }
+
+  /** Forget changed regions, after they have been uploaded */
+  void Clean() { dirty_.clear(); }
+
   /** Returns true if the surface is valid */
   bool Valid() { return ptr_ != NULL && ptr_->w && ptr_->h; }
 
@@ -85,6 +129,18 @@ private:
   void Alloc(int width, int height);
   void Validate(int x, int y) const;
 
+  /** Returns true if the surface has 32-bit pixels with 8-bit channels so
+      it can be operated on a row at a time */
+  bool Raw() const;
+
+  /** Returns a pointer to the first pixel of a row on a raw surface */
+  Uint32* Row(int y) const
+    { return (Uint32*)((Uint8*)ptr_->pixels + y * ptr_->pitch); }
+
+  /** Maximum number of separate dirty rectangles kept */
+  enum { DIRTY_MAX = 8 };
+
+  std::vector<Rect> dirty_;
   int lock_;
 };
 
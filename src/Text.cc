@@ -11,20 +11,147 @@
 \******************************************************************************/
 
 #include "math.h"
+#include "os.h"
+#include "str.h"
 #include "Sprite.h"
+#include "SpriteBatch.h"
 #include "Text.h"
 
 namespace dragoon {
 
+namespace {
+
+  // Distance field glyphs are rendered at this multiple of the sheet size
+  const int DISTANCE_UPSCALE = 4;
+
+  // Distance in sheet pixels from the glyph edge to where alpha saturates
+  const int DISTANCE_SPREAD = 2;
+
+  // Fill a surface with the distance to the edge of a glyph rendered at
+  // DISTANCE_UPSCALE times its size. Alpha is one half on the edge.
+  void Distance(Surface& glyph, Surface& field) {
+    if (!glyph.Lock())
+      return;
+    int gw = glyph->w, gh = glyph->h;
+    std::vector<unsigned char> inside(gw * gh);
+    for (int y = 0; y < gh; ++y)
+      for (int x = 0; x < gw; ++x)
+        inside[y * gw + x] = glyph.Get(x, y).a() >= 0.5f;
+    glyph.Unlock();
+
+    // Search the neighborhood of each sample for the nearest pixel on the
+    // other side of the edge
+    if (!field.Lock())
+      return;
+    int radius = DISTANCE_SPREAD * DISTANCE_UPSCALE;
+    for (int y = 0; y < field->h; ++y)
+      for (int x = 0; x < field->w; ++x) {
+        int cx = x * DISTANCE_UPSCALE + DISTANCE_UPSCALE / 2;
+        int cy = y * DISTANCE_UPSCALE + DISTANCE_UPSCALE / 2;
+        bool in = cx < gw && cy < gh && inside[cy * gw + cx];
+        int best = radius * radius;
+        for (int dy = -radius; dy <= radius; ++dy) {
+          int sy = cy + dy;
+          for (int dx = -radius; dx <= radius; ++dx) {
+            int sx = cx + dx, d = dx * dx + dy * dy;
+            if (d >= best)
+              continue;
+            bool s_in = sx >= 0 && sy >= 0 && sx < gw && sy < gh &&
+                        inside[sy * gw + sx];
+            if (s_in != in)
+              best = d;
+          }
+        }
+        float dist = 0.5f * sqrtf((float)best) / radius;
+        field.Put(x, y, Color(1, 1, 1, in ? 0.5f + dist : 0.5f - dist));
+      }
+    field.Unlock();
+  }
+
+  /** Generates the distance field for one glyph of a font sheet on a worker
+      thread and copies it onto the sheet when finished */
+  class DistanceJob: public Jobs::Job {
+  public:
+    DistanceJob(SDL_Surface* glyph, Surface& sheet, int x, int y, int w,
+                int h, Jobs::Job*& self):
+      glyph_(glyph), field_(w, h), sheet_(sheet), self_(self), x_(x), y_(y)
+    {
+      self = this;
+    }
+
+    virtual void Run() { Distance(glyph_, field_); }
+
+    virtual void Finish() {
+      field_.Blit(sheet_, 0, 0, field_->w, field_->h, x_, y_);
+      self_ = NULL;
+    }
+
+  private:
+    Surface glyph_;
+    Surface field_;
+    Surface& sheet_;
+    Jobs::Job*& self_;
+    int x_;
+    int y_;
+  };
+}
+
 ptr::Scope<Text::Font> Text::default_font_;
+Count Text::allocs$;
+var::Bool Text::Font::cache$("text.font_cache", true,
+                             "Cache rendered font sheets in the user "
+                             "directory");
+var::Int Text::Font::glyph_pages$("text.glyph_pages", 2,
+                                  "Maximum number of pages for characters "
+                                  "not on the font sheet");
+var::Int Text::Font::glyph_page_size$("text.glyph_page_size", 256,
+                                      "Glyph page size in pixels");
+var::Int Text::Font::distance_size$("text.distance_size", 32,
+                                    "Point size of distance field font "
+                                    "sheets");
 
-Text::Font::Font(const char* filename, float size, float scale):
-  scale_(scale), first_(' '), cols_(16), rows_(6)
+Text::Font::Font(const char* filename, float size, float scale,
+                 bool distance):
+  scale_(scale), first_(' '), cols_(16), rows_(6), ttf_(NULL),
+  distance_(distance)
 {
-  // Load font file
+  // Distance field sheets are made once at a fixed size and scaled to the
+  // requested size when drawn. Glyphs are rasterized larger than the sheet.
+  int upscale = 1;
+  if (distance) {
+    scale_ *= size / distance_size$;
+    size = distance_size$ * DISTANCE_UPSCALE;
+    scale = 0;
+    upscale = DISTANCE_UPSCALE;
+  }
+
+  // Identify the rendered sheet by the font file contents
+  std::string stamp, cache_name;
+  size_t length;
+  const void* data;
+  if (cache$ && os::CacheDir() && (data = os::MapFile(filename, length))) {
+    char buf[128];
+    snprintf(buf, sizeof (buf), " %08x %g %g%s", str::Hash(data, length),
+             size, scale, distance ? " distance" : "");
+    os::UnmapFile(data, length);
+    stamp = filename;
+    stamp += buf;
+    snprintf(buf, sizeof (buf), "/%08x.fnt", str::Hash(stamp.c_str()));
+    cache_name = os::CacheDir();
+    cache_name += buf;
+  }
+
+  // Load font file, it is kept open to render characters on demand
   TTF_Font* font = TTF_OpenFont(filename, size);
   if (!font) {
-    WARN("Failed to load font '%s' at %dpt", filename, size);
+    WARN("Failed to load font '%s' at %gpt", filename, size);
+    return;
+  }
+  ttf_ = font;
+  if (!stamp.empty() && LoadCache(cache_name, stamp)) {
+    DEBUG("Loaded font sheet for '%s' from cache", filename);
+    if (!distance)
+      ptr_->Pack();
     return;
   }
 
@@ -34,6 +161,8 @@ Text::Font::Font(const char* filename, float size, float scale):
   for (int c = first_; c < first_ + cols_ * rows_; ++c) {
     char text[2] = { c, 0 };
     TTF_SizeUTF8(font, text, &w2, &h2);
+    w2 = (w2 + upscale - 1) / upscale;
+    h2 = (h2 + upscale - 1) / upscale;
     if (w2 > w)
       w = w2;
     if (h2 > h)
@@ -44,71 +173,272 @@ Text::Font::Font(const char* filename, float size, float scale):
   w += 2;
   h += 2;
 
-  // Render a font sheet
+  // Render a font sheet. Distance fields are generated on worker threads
+  // but glyphs are rasterized here, SDL_ttf is not thread-safe.
   ptr_ = new Texture(w * cols_, h * rows_);
+  std::vector<Jobs::Job*> jobs(cols_ * rows_);
   SDL_Color white = { 255, 255, 255, 255 };
   for (int c = first_; c < first_ + cols_ * rows_; ++c) {
     char text[2] = { c, 0 };
-    TTF_SizeUTF8(font, text, &w2, &h2);
-    Surface surf(TTF_RenderUTF8_Blended(font, text, white));
-    if (!surf) {
+    int x = ((c - first_) % cols_) * w, y = (c - first_) / cols_ * h;
+    SDL_Surface* glyph = TTF_RenderUTF8_Blended(font, text, white);
+    if (!glyph)
       WARN("TTF_RenderUTF8_Blended() failed: %s", TTF_GetError());
-      return;
+    else if (distance)
+      Jobs::Add(new DistanceJob(glyph, ptr_->surface(), x, y, w - 1, h - 1,
+                                jobs[c - first_]));
+    else {
+      Surface surf(glyph);
+      surf.BlitShadowed(ptr_->surface(), 0, 0, surf->w, surf->h, x, y,
+                        1, 1, Color::black());
+    }
+  }
+  for (int i = 0; i < (int)jobs.size(); ++i)
+    if (jobs[i])
+      Jobs::Wait(jobs[i]);
+  if (!stamp.empty())
+    SaveCache(cache_name, stamp);
+  if (!distance)
+    ptr_->Pack();
+}
+
+bool Text::Font::LoadCache(const std::string& cache_name,
+                           const std::string& stamp) {
+  long long size, mtime;
+  if (!os::FileInfo(cache_name.c_str(), size, mtime))
+    return false;
+  FILE* file = os::OpenRead(cache_name.c_str());
+  if (!file)
+    return false;
+
+  // Metadata must be complete and made from the same font
+  char line[512];
+  int w, h;
+  ptr::Scope<int, ptr::DeleteArray> widths(new int[cols_ * rows_]);
+  bool success = fgets(line, sizeof (line), file) &&
+                 !strncmp(line, stamp.c_str(), stamp.size()) &&
+                 line[stamp.size()] == '\n' &&
+                 fscanf(file, "%d %d", &w, &h) == 2;
+  for (int i = 0; success && i < cols_ * rows_; ++i)
+    success = fscanf(file, "%d", widths + i) == 1;
+  fclose(file);
+  if (!success)
+    return false;
+
+  // Load the sheet itself
+  Surface sheet;
+  if (!sheet.LoadRaw((cache_name + ".tex").c_str(), stamp))
+    return false;
+  box_size_ = Vec<2>(w, h);
+  widths_ = widths;
+  widths = NULL;
+  ptr_ = new Texture(sheet->w, sheet->h);
+  ptr_->surface().Swap(sheet);
+  return true;
+}
+
+void Text::Font::SaveCache(const std::string& cache_name,
+                           const std::string& stamp) {
+  if (!ptr_->surface().SaveRaw((cache_name + ".tex").c_str(), stamp))
+    return;
+
+  // Write to a temporary file first so a partial file is never loaded
+  std::string temp_name = cache_name + ".tmp";
+  FILE* file = os::OpenWrite(temp_name.c_str());
+  if (!file)
+    return;
+  bool success = fprintf(file, "%s\n%d %d\n", stamp.c_str(),
+                         (int)box_size_.x(), (int)box_size_.y()) > 0;
+  for (int i = 0; success && i < cols_ * rows_; ++i)
+    success = fprintf(file, "%d%c", widths_[i],
+                      i % cols_ == cols_ - 1 ? '\n' : ' ') > 0;
+  success = !fclose(file) && success;
+  success = success && !rename(temp_name.c_str(), cache_name.c_str());
+  if (!success)
+    remove(temp_name.c_str());
+}
+
+int Text::Font::Lookup(unsigned int ch) const {
+  std::map<unsigned int, int>::iterator it = slot_map_.find(ch);
+  if (it != slot_map_.end()) {
+    Touch(it->second, ch);
+    return it->second;
+  }
+  if (!ttf_ || !ptr_)
+    return -1;
+
+  // Slots are wide enough for double-width characters
+  int slot_w = 2 * ((int)box_size_.x() + 1);
+  int slot_h = (int)box_size_.y() + 1;
+
+  // Add a glyph page if every slot is taken and the limit allows it
+  if (lru_.empty() || slots_[lru_.back()].ch) {
+    int page_size = glyph_page_size$;
+    int cols = page_size / slot_w, rows = page_size / slot_h;
+    if ((int)pages_.size() < glyph_pages$ && cols > 0 && rows > 0) {
+      Texture* page = new Texture(page_size, page_size);
+      pages_.push_back(page);
+      for (int y = 0; y < rows; ++y)
+        for (int x = 0; x < cols; ++x) {
+          Slot slot;
+          slot.page = page;
+          slot.origin = Vec<2>(x * slot_w, y * slot_h);
+          slot.ch = 0;
+          slot.frame = -1;
+          slots_.push_back(slot);
+          slots_.back().lru = lru_.insert(lru_.end(), slots_.size() - 1);
+        }
+      DEBUG("Added glyph page %d with %d slots", (int)pages_.size(),
+            cols * rows);
     }
-    surf.BlitShadowed(ptr_->surface(), 0, 0, surf->w, surf->h,
-                      ((c - first_) % cols_) * w, (c - first_) / cols_ * h,
-                      1, 1, Color::black());
   }
 
-  TTF_CloseFont(font);
+  // Evict the least recently used glyph unless it is still being drawn
+  if (lru_.empty())
+    return -1;
+  int index = lru_.back();
+  Slot& slot = slots_[index];
+  if (slot.ch) {
+    if (slot.frame == Timer::frame())
+      return SLOT_BUSY;
+    slot_map_.erase(slot.ch);
+    slot.ch = 0;
+  }
+
+  // Rasterize the character into the slot
+  char text[5];
+  str::EncodeUTF8(ch, text);
+  SDL_Color white = { 255, 255, 255, 255 };
+  Surface surf(TTF_RenderUTF8_Blended(ttf_, text, white));
+  if (!surf) {
+    WARN("TTF_RenderUTF8_Blended() failed: %s", TTF_GetError());
+    return -1;
+  }
+  int w, h;
+  TTF_SizeUTF8(ttf_, text, &w, &h);
+  Surface& page = slot.page->surface();
+  int x = (int)slot.origin.x(), y = (int)slot.origin.y();
+  page.Clear(x, y, slot_w, slot_h);
+  if (distance_) {
+    Surface field(slot_w - 1, slot_h - 1);
+    Distance(surf, field);
+    field.Blit(page, 0, 0, field->w, field->h, x, y);
+    w = (w + DISTANCE_UPSCALE - 1) / DISTANCE_UPSCALE;
+  } else
+    surf.BlitShadowed(page, 0, 0, std::min(surf->w, slot_w - 1),
+                      std::min(surf->h, slot_h - 1), x, y, 1, 1,
+                      Color::black());
+  slot.box = Vec<2>(std::min(w + 1, slot_w), box_size_.y());
+  slot.ch = ch;
+  slot_map_[ch] = index;
+  Touch(index, ch);
+  return index;
 }
 
 void Text::SetText(const char *string) {
+  size_t string_capacity = string_.capacity();
   string_ = string;
-  sprites_.Release();
-  if (font_) {
-    sprites_ = new Sprite[string_.length()];
-    for (unsigned int i = 0; i < string_.length(); i++)
-      sprites_[i].set_size(font_->box_size_ * font_->scale_);
-  } else
-    sprites_ = NULL;
+  if (string_.capacity() != string_capacity)
+    ++allocs$;
+  glyph_count_ = 0;
+  extents_ = Vec<2>(0, 0);
+  if (!font_)
+    return;
+
+  // Grow glyph storage geometrically
+  int length = string_.length();
+  if (length > glyph_capacity_) {
+    glyph_capacity_ = std::max(glyph_capacity_ * 2, length);
+    heap_glyphs_.Release();
+    heap_glyphs_ = new Glyph[glyph_capacity_];
+    ++allocs$;
+  }
+
+  // Lay out the glyphs, characters that are not on the font sheet come from
+  // the glyph pages. Glyphs that find every slot busy keep a full box and are
+  // rasterized when drawn. Control characters are skipped. There are never
+  // more characters than bytes.
+  Vec<2> offset_sz = font_->box_size_ + 1;
+  int ch_max = font_->rows_ * font_->cols_;
+  float x = 0;
+  const char* s = string_.c_str();
+  for (int i = 0; *s; i++) {
+    unsigned int ch = str::DecodeUTF8(s);
+    int sheet_ch = (int)ch - font_->first_;
+    Glyph& glyph = glyphs()[glyph_count_];
+    if (sheet_ch >= 0 && sheet_ch < ch_max) {
+      glyph.texture = *font_;
+      glyph.slot = -1;
+      glyph.box_origin = offset_sz * Vec<2>(sheet_ch % font_->cols_,
+                                            sheet_ch / font_->cols_);
+      glyph.box_size = font_->box(ch);
+    } else if (ch < 0x20 || ch == 0x7f)
+      continue;
+    else if ((glyph.slot = font_->Lookup(ch)) >= 0) {
+      const Font::Slot& slot = font_->slots_[glyph.slot];
+      glyph.texture = slot.page;
+      glyph.box_origin = slot.origin;
+      glyph.box_size = slot.box;
+    } else if (glyph.slot == Font::SLOT_BUSY) {
+      glyph.texture = NULL;
+      glyph.box_size = font_->box();
+    } else
+      continue;
+    glyph.ch = ch;
+    glyph.size = glyph.box_size * font_->scale_;
+    glyph.offset = Vec<2>(x, 0);
+    glyph.index = i;
+    x += glyph.size.x();
+    ++glyph_count_;
+  }
+  extents_ = Vec<2>(x, font_->size().y());
 }
 
 void Text::Draw() {
-  if (!font_ || !(*font_)->Valid() || !sprites_)
+  if (!font_ || !(*font_)->Valid() || !glyph_count_ || z_ < 0.f ||
+      modulate_.a() <= 0.f)
     return;
 
-  // Setup sprite data for all characters
-  Sprite::Data sprite_data;
-  sprite_data.texture_ = *font_;
-  sprite_data.modulate_ = modulate_;
-  sprite_data.scale_ = scale_ * font_->scale_;
-  sprite_data.center_ = font_->box_size_ / 2;
+  // Glyphs on the same page share a render state. Distance fields are
+  // always filtered smoothly and never need upscaling.
+  SpriteBatch::State state(*font_, font_->distance_ ?
+                           Sprite::Data::BLEND_DISTANCE :
+                           Sprite::Data::BLEND_ALPHA,
+                           !font_->distance_ && jiggle_radius_ != 0);
+  Vec<2> surface_sz = state.texture->size();
 
   // Prepare effects
   int seed = (int)(size_t)this;
   float explode_norm = explode_.Zero() ? sqrtf(explode_.Len()) : 0;
+  float time = Timer::time() * jiggle_speed_;
 
-  // Draw letters
-  glMatrixMode(GL_MODELVIEW);
-  Vec<2> offset_sz = font_->box_size_ + 1;
-  float x = 0;
-  int ch_max = font_->rows_ * font_->cols_;
-  for (unsigned int i = 0; i < string_.length(); i++) {
+  // Submit letters
+  for (int i = 0; i < glyph_count_; i++) {
+    Glyph& glyph = glyphs()[i];
 
-    // Check character range
-    int ch = string_[i] - font_->first_;
-    if (ch < 0 || ch >= ch_max)
+    // Glyphs evicted from their page or still waiting for a slot are
+    // rasterized again
+    if (glyph.slot == Font::SLOT_BUSY ||
+        (glyph.slot >= 0 && !font_->Touch(glyph.slot, glyph.ch))) {
+      glyph.slot = font_->Lookup(glyph.ch);
+      if (glyph.slot < 0) {
+        if (glyph.slot != Font::SLOT_BUSY)
+          glyph.texture = NULL;
+        continue;
+      }
+      const Font::Slot& slot = font_->slots_[glyph.slot];
+      glyph.texture = slot.page;
+      glyph.box_origin = slot.origin;
+    }
+    if (!glyph.texture)
       continue;
+    if (glyph.texture != state.texture) {
+      state.texture = glyph.texture;
+      surface_sz = state.texture->size();
+    }
 
-    // Setup sprite data for this character
-    Vec<2> origin = origin_ + Vec<2>(x, 0);
-    Vec<2> coords = Vec<2>(ch % font_->cols_, ch / font_->cols_);
-    sprite_data.box_size_ = font_->size(font_->first_ + ch);
-    sprite_data.box_origin_ = offset_sz * coords;
-    Sprite& sprite = sprites_[i] = Sprite(&sprite_data);
-    sprite.set_size(sprite.size() * scale_);
-    x += sprite_data.box_size_.x() * scale_.x();
+    Vec<2> size = glyph.size * scale_;
+    Vec<2> origin = origin_ + glyph.offset * scale_;
 
     // Letter explode effect
     if (explode_norm) {
@@ -120,30 +450,25 @@ void Text::Draw() {
       origin += diff * diff.Len();
     }
 
-    // Letter jiggle effect
+    // Letter jiggle effect rotates each glyph around its center
+    Sprite::Transform xf;
     if (jiggle_radius_ != 0) {
-      float time = Timer::time() * jiggle_speed_;
-      origin += Vec<2>(sin(time + 787 * i), cos(time + 386 * i))
+      int n = glyph.index;
+      origin += Vec<2>(sin(time + 787 * n), cos(time + 386 * n))
                 * jiggle_radius_;
-      sprite.set_angle(0.1 * jiggle_radius_ * sin(time + 911 * i));
-    } else
-      sprite.set_angle(0);
+      float angle = 0.1 * jiggle_radius_ * sin(time + 911 * n);
+      xf.rotation = Vec<2>(cosf(angle), sinf(angle));
+    }
 
-    // Draw character sprite
-    glPushMatrix();
-    glTranslatef(origin.x(), origin.y(), z_);
-    sprite.Draw();
-    glPopMatrix();
+    // Submit glyph quad
+    xf.origin = origin + size / 2;
+    xf.scale = size;
+    xf.z = z_;
+    SpriteBatch::Add(state, xf, Vec<2>(-0.5f, -0.5f), Vec<2>(0.5f, 0.5f),
+                     glyph.box_origin / surface_sz,
+                     (glyph.box_origin + glyph.box_size) / surface_sz,
+                     modulate_);
   }
-
-  Mode::Check();
-}
-
-Vec<2> Text::Size() {
-  Vec<2> size = Vec<2>(0, font_->size().y());
-  for (int i = 0; i < (int)string_.length(); ++i)
-    size[0] += font_->size(string_[i]).x();
-  return size * scale_;
 }
 
 } // namespace dragoon
@@ -14,6 +14,7 @@
 #include "log.h"
 #include "ptr.h"
 #include "Sprite.h"
+#include "Timer.h"
 
 namespace dragoon {
 
@@ -23,7 +24,10 @@ class Text:
   public param::Origin, public param::Scale, public param::Z {
 public:
 
-  /** Bitmap font sheet */
+  /** Bitmap font sheet. Fonts loaded from TTF files also rasterize
+      characters that are not on the sheet when they are first used, onto a
+      bounded number of glyph pages that evict the least recently used
+      glyphs when full. */
   class Font: public ptr::Wrap<Texture> {
   public:
 
@@ -35,7 +39,7 @@ public:
      */
     Font(Texture* texture, int first, int cols, int rows, float scale = 1):
       ptr::Wrap<Texture>(texture), box_size_(0, 0), scale_(scale),
-      first_(first), cols_(cols), rows_(rows)
+      first_(first), cols_(cols), rows_(rows), ttf_(NULL), distance_(false)
     {
       if (texture->Valid())
         box_size_ = texture->size() / Vec<2>(cols, rows) - 1;
@@ -43,21 +47,74 @@ public:
         WARN("Font texture '%s' invalid", texture ? texture->name() : "(null)");
     }
 
-    /** Initialize font sheet from monospace TTF font file.
+    /** Initialize font sheet from monospace TTF font file. Rendered sheets
+        are cached in the user directory keyed by the font file contents,
+        point size and scale.
      *  @param filename  Font file path
+     *  @param distance  Make a distance field sheet that stays sharp at any
+     *                   size, one sheet is shared by all sizes
      */
-    Font(const char* filename, float size, float scale = 1);
+    Font(const char* filename, float size, float scale = 1,
+         bool distance = false);
+
+    ~Font() {
+      if (ttf_)
+        TTF_CloseFont(ttf_);
+    }
 
     /** Get character dimensions */
-    Vec<2> size(int ch = 0) const {
+    Vec<2> size(int ch = 0) const { return box(ch) * scale_; }
+
+  protected:
+    friend class Text;
+
+    /** Load the font sheet and character widths from the cache
+     *  @returns true if the cache files were valid and had a matching stamp
+     */
+    bool LoadCache(const std::string& cache_name, const std::string& stamp);
+
+    /** Save the font sheet and character widths to the cache */
+    void SaveCache(const std::string& cache_name, const std::string& stamp);
+
+    /** Get character dimensions on the font sheet */
+    Vec<2> box(int ch = 0) const {
       Vec<2> size = box_size_;
       if (widths_ && ch >= first_ && ch < first_ + cols_ * rows_)
         size[0] = widths_[ch - first_];
-      return size * scale_;
+      return size;
     }
 
-  protected:
-    friend class Text;
+    /** Lookup() result when every slot is in use this frame */
+    enum { SLOT_BUSY = -2 };
+
+    /** Find the glyph page slot holding a character that is not on the font
+        sheet, rasterizing it if necessary, and mark it as recently used.
+     *  @returns Slot index, SLOT_BUSY if no slot is free this frame or -1 if
+     *           the character cannot be rendered
+     */
+    int Lookup(unsigned int ch) const;
+
+    /** Mark a slot as used this frame
+     *  @returns false if the slot no longer holds the character
+     */
+    bool Touch(int slot, unsigned int ch) const {
+      Slot& s = slots_[slot];
+      if (s.ch != ch)
+        return false;
+      s.frame = Timer::frame();
+      lru_.splice(lru_.begin(), lru_, s.lru);
+      return true;
+    }
+
+    /** Glyph page area holding one rasterized character */
+    struct Slot {
+      Texture* page;
+      Vec<2> origin;
+      Vec<2> box;
+      unsigned int ch;
+      int frame;
+      std::list<int>::iterator lru;
+    };
 
     Vec<2> box_size_;
     ptr::Scope<int, ptr::DeleteArray> widths_;
@@ -65,10 +122,24 @@ public:
     int first_;
     int cols_;
     int rows_;
+
+    // Glyphs rasterized on demand, most recently used first
+    mutable TTF_Font* ttf_;
+    mutable ptr::Scope<Texture>::Vector pages_;
+    mutable std::vector<Slot> slots_;
+    mutable std::list<int> lru_;
+    mutable std::map<unsigned int, int> slot_map_;
+    bool distance_;
+
+    static var::Bool cache$;
+    static var::Int glyph_pages$;
+    static var::Int glyph_page_size$;
+    static var::Int distance_size$;
   };
 
   /** Initialize text */
-  Text(const char* string = "", const Font* font = NULL): font_(font) {
+  Text(const char* string = "", const Font* font = NULL):
+    font_(font), glyph_count_(0), glyph_capacity_(INLINE_GLYPHS) {
     SetFont(font);
     SetText(string);
   }
@@ -76,7 +147,8 @@ public:
   /** Center the text object on a point */
   void CenterOn(Vec<2> origin) { origin_ = origin - Size() / 2; }
 
-  /** Draw the text object on screen */
+  /** Submit all glyphs of the text object to the sprite batch. Glyphs share
+      a render state so the string is drawn with a single call. */
   void Draw();
 
   /** Set font */
@@ -85,21 +157,50 @@ public:
     SetText(string_.c_str());
   }
 
-  /** Set text */
+  /** Set UTF-8 text and lay out its glyphs. Glyph storage is reused, so the
+      heap is only touched when the string is longer than any before it. */
   void SetText(const char* string);
 
   /** Returns the dimensions of the text object */
-  Vec<2> Size();
+  Vec<2> Size() const { return extents_ * scale_; }
 
   /** Specify font object used when no font is given to a Text object */
   static void set_default_font(Font* font) { default_font_ = font; }
 
+  /** Counter for heap allocations made by text objects */
+  static Count allocs$;
+
 private:
+
+  /** Glyph placement, computed when the text or font changes. Positions and
+      sizes do not include the text scale. */
+  struct Glyph {
+    Vec<2> offset;     ///< Top-left corner relative to the text origin
+    Vec<2> size;       ///< Size on screen
+    Vec<2> box_origin; ///< Top-left corner on the font sheet in pixels
+    Vec<2> box_size;   ///< Size on the font sheet in pixels
+    Texture* texture;  ///< Font sheet, glyph page or NULL if not drawn
+    unsigned int ch;   ///< Character code
+    int slot;          ///< Glyph page slot, -1 if on the font sheet or
+                       ///< Font::SLOT_BUSY while waiting for a free slot
+    int index;         ///< Position in the string, seeds effects
+  };
+
+  /** Number of glyphs stored in the text object itself */
+  enum { INLINE_GLYPHS = 32 };
+
+  /** Returns the glyph array in use */
+  Glyph* glyphs() { return heap_glyphs_ ? heap_glyphs_ : inline_glyphs_; }
+
   static ptr::Scope<Font> default_font_;
 
   const Font* font_;
   std::string string_;
-  ptr::Scope<Sprite, ptr::DeleteArray> sprites_;
+  Glyph inline_glyphs_[INLINE_GLYPHS];
+  ptr::Scope<Glyph, ptr::DeleteArray> heap_glyphs_;
+  int glyph_count_;
+  int glyph_capacity_;
+  Vec<2> extents_;
 };
 
 } // namespace dragoon
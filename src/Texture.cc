@@ -12,6 +12,9 @@
 
 #include "log.h"
 #include "math.h"
+#include "os.h"
+#include "str.h"
+#include "Atlas.h"
 #include "Timer.h"
 #include "Mode.h"
 #include "Texture.h"
@@ -19,6 +22,100 @@
 namespace dragoon {
 
 Texture::textures$T Texture::textures$;
+var::Bool Texture::cache$("texture.cache", true,
+                          "Cache decoded textures in the user directory");
+int Texture::loaded$;
+int Texture::cached$;
+int Texture::reloads$;
+unsigned int Texture::load_msec$;
+unsigned int Texture::load_start$;
+unsigned int Texture::load_end$;
+std::deque<Texture*> Texture::uploads$;
+var::Int Texture::upload_budget$("texture.upload_budget", 4096,
+                                 "Kilobytes of texture data uploaded per "
+                                 "frame, 0 for no limit");
+int Texture::upload_bytes$;
+int Texture::upload_frame$;
+
+/** Decodes and deseams a texture image on a worker thread. Processed images
+    are cached in the user directory keyed by the image path and are only
+    reused if the image file has the same size and modification time.
+    Reloaded images are kept by the job until they are swapped in. */
+class Texture::LoadJob: public Jobs::Job {
+public:
+  LoadJob(Texture* texture, bool reload = false):
+    texture_(texture), msec_(0), cached_(false), reload_(reload) {
+    if (cache$ && os::CacheDir()) {
+      char buf[16];
+      snprintf(buf, sizeof (buf), "/%08x.tex", str::Hash(texture->name()));
+      cache_name_ = os::CacheDir();
+      cache_name_ += buf;
+    }
+  }
+
+  virtual void Run() {
+    unsigned int start = SDL_GetTicks();
+    Surface surface;
+
+    // Try the cache first
+    std::string stamp;
+    long long size, mtime;
+    if (!cache_name_.empty() &&
+        os::FileInfo(texture_->name(), size, mtime)) {
+      char buf[64];
+      snprintf(buf, sizeof (buf), " %lld %lld", size, mtime);
+      stamp = texture_->name_ + buf;
+      cached_ = surface.LoadRaw(cache_name_.c_str(), stamp);
+    }
+
+    // Decode the image and update the cache
+    if (!cached_) {
+      Surface decoded(texture_->name());
+      decoded.Deseam();
+      surface.Swap(decoded);
+      if (!stamp.empty())
+        surface.SaveRaw(cache_name_.c_str(), stamp);
+    }
+
+    if (reload_)
+      reloaded_.Swap(surface);
+    else
+      texture_->surface_.Swap(surface);
+    msec_ = SDL_GetTicks() - start;
+  }
+
+  virtual void Finish() {
+    if (reload_) {
+      texture_->reloading_ = false;
+      if (reloaded_.Valid())
+        texture_->Replace(reloaded_);
+      else
+        WARN("Failed to reload '%s'", texture_->name());
+    } else {
+      texture_->job_ = NULL;
+      texture_->Pack();
+    }
+
+    // The file changed again while it was being loaded
+    if (texture_->stale_) {
+      texture_->stale_ = false;
+      Reload(texture_->name());
+    }
+    ++loaded$;
+    if (cached_)
+      ++cached$;
+    load_msec$ += msec_;
+    load_end$ = SDL_GetTicks();
+  }
+
+private:
+  Texture* texture_;
+  Surface reloaded_;
+  std::string cache_name_;
+  unsigned int msec_;
+  bool cached_;
+  bool reload_;
+};
 
 Texture* Texture::Load(const char* name) {
   std::string key(name);
@@ -29,34 +126,168 @@ Texture* Texture::Load(const char* name) {
   return pt;
 }
 
+bool Texture::Reload(const char* name) {
+  textures$T::iterator it = textures$.find(name);
+  if (it == textures$.end())
+    return false;
+  Texture* texture = it->second;
+  if (texture->job_ || texture->reloading_)
+    texture->stale_ = true;
+  else {
+    DEBUG("Reloading texture '%s'", name);
+    texture->reloading_ = true;
+    Jobs::Add(new LoadJob(texture, true));
+  }
+  return true;
+}
+
+void Texture::Replace(Surface& surface) {
+  int old_w = surface_ ? surface_->w : 0;
+  int old_h = surface_ ? surface_->h : 0;
+  surface_.Swap(surface);
+  if (atlas_ && surface_->w <= old_w && surface_->h <= old_h) {
+    int x = (int)atlas_origin_.x(), y = (int)atlas_origin_.y();
+    if (surface_->w != old_w || surface_->h != old_h)
+      atlas_->surface_.Clear(x, y, old_w, old_h);
+    surface_.Blit(atlas_->surface_, 0, 0, surface_->w, surface_->h, x, y);
+  } else {
+
+    // Pages cannot take back the old place, so images that grew are not
+    // packed again and new pages are never allocated for reloads
+    atlas_ = NULL;
+    Invalidate();
+  }
+  ++version_;
+  ++reloads$;
+}
+
 void Texture::Reset() {
   int count = 0;
   for (textures$T::iterator it = textures$.begin(), end = textures$.end();
        it != end; ++it) {
     it->second->up_scale_ = false;
     if (WINDOWS) {
-      glDeleteTextures(1, &it->second->gl_name_);
-      it->second->gl_name_ = 0;
+      Mode::DeleteTexture(it->second->gl_name_);
+      it->second->uploaded_ = false;
     }
     ++count;
   }
   DEBUG("Reset %d textures", count);
 }
 
+void Texture::UploadQueued() {
+  while (!uploads$.empty()) {
+    Texture* texture = uploads$.front();
+    if (texture->queued_) {
+      if (!texture->Budget())
+        break;
+      texture->Upload();
+    }
+    uploads$.pop_front();
+  }
+}
+
+Texture* Texture::Placeholder() {
+  static Texture* placeholder;
+  if (!placeholder) {
+    placeholder = new Texture(1, 1);
+    placeholder->stream_ = false;
+    textures$["placeholder"] = placeholder;
+  }
+  return placeholder;
+}
+
+bool Texture::Budget() {
+  if (!stream_ || upload_budget$ <= 0)
+    return true;
+  if (upload_frame$ != Timer::frame()) {
+    upload_frame$ = Timer::frame();
+    upload_bytes$ = 0;
+  }
+
+  // At least one texture is uploaded every frame no matter its size
+  int bytes = 0;
+  if (Partial()) {
+    const std::vector<Surface::Rect>& dirty = surface_.dirty();
+    for (int i = 0; i < (int)dirty.size(); ++i)
+      bytes += dirty[i].w * dirty[i].h * 4;
+  } else {
+    bytes = surface_->w * surface_->h * 4;
+    if (up_scale_)
+      bytes *= Mode::scale() * Mode::scale();
+  }
+  if (upload_bytes$ && upload_bytes$ + bytes > upload_budget$ * 1024)
+    return false;
+  upload_bytes$ += bytes;
+  return true;
+}
+
+bool Texture::Partial() const {
+  int scale = up_scale_ ? Mode::scale() : 1;
+  if (!uploaded_ || frame_ < Mode::init_frame() || scale != upload_scale_ ||
+      scale != 1 || surface_.dirty().empty())
+    return false;
+
+  // Tiles are resized to power-of-two dimensions unless they already are
+  return !tile_ || (pow2_width_ == surface_->w && pow2_height_ == surface_->h);
+}
+
+void Texture::WaitAll() {
+  for (textures$T::iterator it = textures$.begin(), end = textures$.end();
+       it != end; ++it)
+    it->second->Wait();
+}
+
+void Texture::LogLoads() {
+  WaitAll();
+  DEBUG("Loaded %d textures, %d from cache, in %u msec (%u msec of work)",
+        loaded$, cached$, loaded$ ? load_end$ - load_start$ : 0, load_msec$);
+}
+
 Texture::~Texture() {
-  if (gl_name_)
-    glDeleteTextures(1, &gl_name_);
+  Wait();
+
+  // Uploading a queued texture early leaves it in the queue, so it must
+  // always be looked for
+  uploads$.erase(std::remove(uploads$.begin(), uploads$.end(), this),
+                 uploads$.end());
+  Mode::DeleteTexture(gl_name_);
 }
 
 Texture::Texture(int width, int height):
-  surface_(width, height), gl_name_(0), frame_(0), up_scale_(false),
-  tile_(false) {}
+  surface_(width, height), atlas_(NULL), job_(NULL), gl_name_(0), frame_(0),
+  upload_scale_(1), version_(0), page_(false), up_scale_(false), tile_(false),
+  queued_(false), stream_(true), uploaded_(false), reloading_(false),
+  stale_(false) {}
 
 void Texture::Upload() {
+  Wait();
 
   // Texture has no surface data
   if (!surface_)
     return;
+  if (!gl_name_)
+    glGenTextures(1, &gl_name_);
+
+  // Only upload the regions of the surface that have changed. Untiled
+  // textures have a one pixel border on the uploaded surface.
+  if (Partial()) {
+    int border = tile_ || page_ ? 0 : 1;
+    Mode::BindTexture(gl_name_);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, surface_->pitch / 4);
+    const std::vector<Surface::Rect>& dirty = surface_.dirty();
+    for (int i = 0; i < (int)dirty.size(); ++i) {
+      const Surface::Rect& r = dirty[i];
+      glTexSubImage2D(GL_TEXTURE_2D, 0, r.x + border, r.y + border, r.w, r.h,
+                      GL_RGBA, GL_UNSIGNED_BYTE, (Uint8*)surface_->pixels +
+                      r.y * surface_->pitch + r.x * 4);
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    surface_.Clean();
+    queued_ = false;
+    Mode::Check();
+    return;
+  }
 
   // Surface size can be upscaled or not
   int scale = 1;
@@ -85,6 +316,18 @@ void Texture::Upload() {
     }
   }
 
+  // Atlas pages already have a border around each packed surface
+  else if (page_) {
+    pow2_width_ = math::NextPow2(real_width);
+    pow2_height_ = math::NextPow2(real_height);
+    if (pow2_width_ != surface_->w || pow2_height_ != surface_->h) {
+      pow2_surface = new Surface(pow2_width_, pow2_height_);
+      surface_.Scale(*pow2_surface, scale, scale, 0, 0);
+    }
+    scale_uv_ = Vec<2>((float)real_width / pow2_width_,
+                       (float)real_height / pow2_height_);
+  }
+
   // Otherwise we use texture coords to isolate a piece and add a
   // one pixel border around the texture
   else {
@@ -104,12 +347,16 @@ void Texture::Upload() {
   }
 
   // Upload the texture to OpenGL and build mipmaps
-  glBindTexture(GL_TEXTURE_2D, gl_name_);
+  Mode::BindTexture(gl_name_);
   Surface& upload_surface = pow2_surface ? *pow2_surface : surface_;
   glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, upload_surface->w,
                upload_surface->h, 0, GL_RGBA, GL_UNSIGNED_BYTE,
                upload_surface->pixels);
   frame_ = Timer::frame();
+  upload_scale_ = scale;
+  queued_ = false;
+  uploaded_ = true;
+  surface_.Clean();
 
   // Repeat wrapping (not supported for NPOT textures)
   glTexParameterf(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
@@ -122,6 +369,7 @@ void Texture::Upload() {
 }
 
 Texture* Texture::Extract(int x, int y, int w, int h) {
+  Wait();
   if (!surface_)
     return NULL;
 
@@ -133,9 +381,25 @@ Texture* Texture::Extract(int x, int y, int w, int h) {
   return dest;
 }
 
+void Texture::Pack() {
+  Wait();
+  if (!atlas_ && !page_ && !tile_)
+    atlas_ = Atlas::Place(surface_, atlas_origin_, name());
+}
+
 void Texture::Select(bool smooth) {
+  Wait();
+
+  // Packed textures select their page and map into it
+  if (atlas_) {
+    atlas_->Select(smooth);
+    Mode::MultTextureMatrix(atlas_origin_ / atlas_->size(),
+                            surface_.size() / atlas_->size());
+    return;
+  }
+
   if (!surface_) {
-    glDisable(GL_TEXTURE_2D);
+    Mode::Disable(GL_TEXTURE_2D);
     return;
   }
 
@@ -156,33 +420,51 @@ void Texture::Select(bool smooth) {
   if (frame_ < Mode::init_frame())
     need_upload = true;
 
-  // Upload texture to OpenGL
-  if (need_upload)
-    Upload();
+  // Changed regions of the surface need to be uploaded
+  if (!surface_.dirty().empty())
+    need_upload = true;
+
+  // Upload texture to OpenGL if the budget allows, otherwise queue it and
+  // draw with the old image or a placeholder in the meantime
+  if (need_upload) {
+    if (Budget())
+      Upload();
+    else if (!queued_) {
+      queued_ = true;
+      uploads$.push_back(this);
+    }
+    if (!uploaded_) {
+      Placeholder()->Select(smooth);
+      return;
+    }
+  }
 
   // Select texture
-  glEnable(GL_TEXTURE_2D);
-  glBindTexture(GL_TEXTURE_2D, gl_name_);
+  Mode::Enable(GL_TEXTURE_2D);
+  Mode::BindTexture(gl_name_);
 
   // Scale filters
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER,
-                  smooth ? GL_LINEAR : GL_NEAREST);
+  Mode::TextureFilters(GL_LINEAR, smooth ? GL_LINEAR : GL_NEAREST);
 
   // Non-power-of-two textures are pasted onto larger textures that require a
   // texture coordinate transformation
-  glMatrixMode(GL_TEXTURE);
-  glLoadIdentity();
-  if (!tile_)
-    glTranslatef(1.f / pow2_width_, 1.f / pow2_height_, 0.f);
-  glScalef(scale_uv_[0], scale_uv_[1], 1.f);
-  glMatrixMode(GL_MODELVIEW);
+  Vec<2> translate(0, 0);
+  if (!tile_ && !page_)
+    translate = Vec<2>(1.f / pow2_width_, 1.f / pow2_height_);
+  Mode::TextureMatrix(translate, scale_uv_);
 
   Mode::Check();
 }
 
 Texture::Texture(const char* filename):
-  surface_(filename), name_(filename), gl_name_(0), frame_(0), up_scale_(false),
-  tile_(false) { surface_.Deseam(); }
+  name_(filename), atlas_(NULL), job_(NULL), gl_name_(0), frame_(0),
+  upload_scale_(1), version_(0), page_(false), up_scale_(false),
+  tile_(false), queued_(false), stream_(true), uploaded_(false),
+  reloading_(false), stale_(false) {
+  if (!load_start$)
+    load_start$ = SDL_GetTicks();
+  job_ = new LoadJob(this);
+  Jobs::Add(job_);
+}
 
 } // namespace dragoon
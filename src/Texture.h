@@ -13,6 +13,8 @@
 #pragma once
 #include "ptr.h"
 #include "Vec.h"
+#include "var.h"
+#include "Jobs.h"
 #include "Mode.h"
 #include "Surface.h"
 
@@ -28,57 +30,167 @@ public:
 
   /** If the texture's SDL surface has changed, the image must be reloaded
       into OpenGL. This function will do this. It is assumed that the texture
-      surface format has not changed since the texture was created. */
+      surface format has not changed since the texture was created. When
+      selected, textures are uploaded within a per-frame budget and keep
+      drawing with their old image until then. Only the dirty regions of the
+      surface are uploaded when that is enough. */
   void Upload();
 
   /** Cut a tilable chunk out of an already loaded texture */
   Texture* Extract(int x, int y, int width, int height);
 
+  /** Pack the texture onto a shared atlas page if it fits. The surface
+      should not change after the texture has been packed. */
+  void Pack();
+
+  /** Force the whole texture to be uploaded the next time it is selected */
+  void Invalidate() { frame_ = 0; }
+
+  /** Returns the texture that is bound to render this one, either an atlas
+      page or the texture itself */
+  Texture* page() {
+    Wait();
+    return atlas_ ? atlas_ : this;
+  }
+
+  /** Map texture coordinates into the texture's atlas page */
+  Vec<2> PageUV(Vec<2> uv) const {
+    Wait();
+    if (!atlas_)
+      return uv;
+    return (atlas_origin_ + uv * surface_.size()) / atlas_->surface_.size();
+  }
+
   /** Selects (binds) a texture for rendering in OpenGL. Also sets whatever
       options are necessary to get the texture to show up properly. */
   void Select(bool smooth = false);
 
   /** Returns true if the texture is valid */
-  bool Valid() { return this && surface_.Valid(); }
+  bool Valid() {
+    if (!this)
+      return false;
+    Wait();
+    return surface_.Valid();
+  }
 
   /** Returns the dimensions of the texture surface */
-  Vec<2> size() const { return surface_.size(); }
+  Vec<2> size() const {
+    Wait();
+    return surface_.size();
+  }
 
   /** Smallest power-of-two dimensions that contain the surface */
   Vec<2> pow2_size() const { return Vec<2>(pow2_width_, pow2_height_); }
 
+  /** Number of times the texture has been reloaded from disk */
+  int version() const { return version_; }
+
   /** Get texture name */
   const char* name() const { return name_.c_str(); }
 
   /** Get surface */
-  Surface& surface() { return surface_; }
+  Surface& surface() {
+    Wait();
+    return surface_;
+  }
 
   /** Deselect current OpenGL texture */
-  static void Deselect() { glDisable(GL_TEXTURE_2D); }
+  static void Deselect() { Mode::Disable(GL_TEXTURE_2D); }
 
-  /** Load a texture from disk or return a reference if already loaded */
+  /** Load a texture from disk or return a reference if already loaded. The
+      image is decoded on a worker thread, using the texture before it has
+      finished loading blocks until it has. */
   static Texture* Load(const char* name);
 
+  /** Load a changed image again on a worker thread. The texture keeps its
+      old image until the new one has been decoded and swapped in when jobs
+      are polled.
+   *  @returns false if no texture was loaded from the file
+   */
+  static bool Reload(const char* name);
+
+  /** Total number of times textures have been reloaded */
+  static int reloads() { return reloads$; }
+
   /** Reset textures */
   static void Reset();
 
+  /** Upload queued textures until this frame's upload budget is spent */
+  static void UploadQueued();
+
+  /** Block until every texture has finished loading */
+  static void WaitAll();
+
+  /** Wait for outstanding loads, then log how many textures were loaded, how
+      many came from the cache, the time from the first load starting to the
+      last one finishing and the time the workers spent on them */
+  static void LogLoads();
+
 protected:
   Texture(const char* name);
 
 private:
+  friend class Atlas;
+  class LoadJob;
+
+  /** Returns true if uploading only the changed regions of the surface is
+      enough to bring the OpenGL texture up to date */
+  bool Partial() const;
+
+  /** Check the upload budget for this frame and spend from it if the
+      texture can be uploaded now */
+  bool Budget();
+
+  /** Returns a blank texture drawn in place of textures that have never
+      been uploaded */
+  static Texture* Placeholder();
+
+  /** Swap in a reloaded image. Packed textures are copied over their old
+      place on the atlas page if the image still fits it, otherwise they
+      become standalone textures. */
+  void Replace(Surface&);
+
+  /** Block until the texture has finished loading */
+  void Wait() const {
+    if (job_)
+      Jobs::Wait(job_);
+  }
+
   typedef ptr::Scope<Texture>::Map<std::string> textures$T;
 
   static textures$T textures$;
-
+  static var::Bool cache$;
+  static int loaded$;
+  static int cached$;
+  static int reloads$;
+  static unsigned int load_msec$;
+  static unsigned int load_start$;
+  static unsigned int load_end$;
+  static std::deque<Texture*> uploads$;
+  static var::Int upload_budget$;
+  static int upload_bytes$;
+  static int upload_frame$;
+
+  Vec<2> atlas_origin_;
   Vec<2> scale_uv_;
   Surface surface_;
   std::string name_;
+  Texture* atlas_;
+  Jobs::Job* job_;
   unsigned int gl_name_;
   int pow2_width_;
   int pow2_height_;
   int frame_;
+  int upload_scale_;
+  int version_;
+  bool page_;
   bool up_scale_;
   bool tile_;
+  bool queued_;
+  bool stream_;
+  bool uploaded_;
+  bool reloading_;
+  bool stale_;
 };
 
 } // namespace dragoon
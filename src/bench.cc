@@ -0,0 +1,383 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#include "bench.h"
+#include "log.h"
+#include "math.h"
+#include "os.h"
+#include "str.h"
+#include "var.h"
+#include "Config.h"
+#include "Mode.h"
+#include "SpriteBatch.h"
+#include "Surface.h"
+#include "Timer.h"
+
+namespace dragoon {
+namespace bench {
+
+namespace {
+
+  // Number of times each benchmark pass is repeated
+  const int PASSES = 10;
+
+  // Fill a surface with random pixels, about half of them transparent
+  void RandomSheet(Surface& surface) {
+    Vec<2> size = surface.size();
+    for (int y = 0; y < size.y(); ++y)
+      for (int x = 0; x < size.x(); ++x) {
+        Color color(math::UnitRand(), math::UnitRand(), math::UnitRand(),
+                    math::UnitRand() < 0.5f ? 0 : math::UnitRand());
+        surface.Put(x, y, color);
+      }
+  }
+
+  // Deseam one pixel at a time through the Color interface
+  void DeseamPerPixel(Surface& surface) {
+    Vec<2> size = surface.size();
+    for (int y = 0; y < size.y(); ++y)
+      for (int x = 0; x < size.x(); ++x) {
+        Color color = surface.Get(x, y);
+        if (color[3])
+          continue;
+        Color sum = Color::black();
+        if (x > 0) {
+          color = surface.Get(x - 1, y);
+          sum += color * color[3];
+        }
+        if (y > 0) {
+          color = surface.Get(x, y - 1);
+          sum += color * color[3];
+        }
+        if (x < size.x() - 1) {
+          color = surface.Get(x + 1, y);
+          sum += color * color[3];
+        }
+        if (y < size.y() - 1) {
+          color = surface.Get(x, y + 1);
+          sum += color * color[3];
+        }
+        sum /= sum[3];
+        sum[3] = 0;
+        surface.Put(x, y, sum);
+      }
+  }
+
+  // Read a config character from a stream
+  int ConfigGetch(FILE* f) {
+    int ch;
+    do {
+      ch = fgetc(f);
+      if (ch == '\\' && (ch = fgetc(f)) == '\n')
+        continue;
+    } while (ch == '\r');
+    if (ch == '#')
+      while (ch != EOF && (ch = fgetc(f)) != '\n');
+    if (ch == '\t')
+      ch = ' ';
+    return ch == EOF ? 0 : ch;
+  }
+
+  // Count the tokens in a config file read one character at a time, the
+  // way the parser used to
+  int CountConfigTokens(FILE* f) {
+    int tokens = 0;
+    std::string token;
+    for (;;) {
+      int ch;
+      for (ch = ConfigGetch(f); ch == ' '; ch = ConfigGetch(f));
+      if (!ch)
+        return tokens;
+      token.clear();
+      if (ch == '"')
+        for (ch = ConfigGetch(f); ch && ch != '"'; ch = ConfigGetch(f))
+          token.push_back(ch);
+      else if (ch != '{' && ch != '}' && ch != '\n')
+        for (; ch; ch = ConfigGetch(f)) {
+          if (ch == ' ' || ch == '{' || ch == '}' || ch == '\n') {
+            ungetc(ch, f);
+            break;
+          }
+          token.push_back(ch);
+        }
+      if (ch != '{' && ch != '}' && ch != '\n')
+        ++tokens;
+    }
+  }
+
+  // Count the tokens in a parsed config tree
+  int CountConfigTokens(const Config::Node* node) {
+    int tokens = 0;
+    for (; node; node = node->next())
+      tokens += node->size() + CountConfigTokens(node->child());
+    return tokens;
+  }
+}
+
+void Run() {
+  WARN("Running benchmarks");
+  Sprites(1000);
+  Sprites(10000);
+  TextureMatrix();
+  Deseam(256);
+  Deseam(1024);
+  Deseam(2048);
+  ParseConfig(1000);
+  ParseConfig(20000);
+  Cull(10000);
+  Cull(100000);
+}
+
+void Sprites(int count) {
+
+  // Random sprite transforms
+  std::vector<Sprite::Transform> xfs(count);
+  for (int i = 0; i < count; ++i) {
+    float angle = math::UnitRand() * 2 * M_PI;
+    xfs[i].origin = Vec<2>(math::UnitRand() * Mode::width(),
+                           math::UnitRand() * Mode::height());
+    xfs[i].scale = Vec<2>(32, math::UnitRand() < 0.5f ? -32 : 32);
+    xfs[i].pivot = Vec<2>(math::UnitRand() * 8, math::UnitRand() * 8);
+    xfs[i].rotation = Vec<2>(cosf(angle), sinf(angle));
+    xfs[i].z = math::UnitRand();
+  }
+  const Vec<2> co0(-0.5f, -0.5f), co1(0.5f, 0.5f), uv0(0, 0), uv1(1, 1);
+  Texture::Deselect();
+  glFinish();
+
+  // Matrix stack, one draw call per sprite
+  Timer::Poll();
+  for (int pass = 0; pass < PASSES; ++pass)
+    for (int i = 0; i < count; ++i) {
+      const Sprite::Transform& xf = xfs[i];
+      Sprite::Vertex verts[4];
+      verts[0].co = co0;
+      verts[1].co = Vec<2>(co0.x(), co1.y());
+      verts[2].co = co1;
+      verts[3].co = Vec<2>(co1.x(), co0.y());
+      for (int j = 0; j < 4; ++j) {
+        verts[j].uv = verts[j].co;
+        verts[j].z = 0;
+      }
+      Mode::MatrixMode(GL_MODELVIEW);
+      glPushMatrix();
+      glTranslatef(xf.origin.x(), xf.origin.y(), xf.z);
+      glTranslatef(xf.pivot.x(), xf.pivot.y(), 0);
+      glRotatef(math::RadToDeg(atan2f(xf.rotation.y(), xf.rotation.x())),
+                0.0, 0.0, 1.0);
+      glTranslatef(-xf.pivot.x(), -xf.pivot.y(), 0);
+      glScalef(xf.scale.x(), xf.scale.y(), 0);
+      glColor4f(1, 1, 1, 1);
+      glInterleavedArrays(Sprite::Vertex::FORMAT, 0, verts);
+      const unsigned short indices[] = { 0, 1, 2, 3 };
+      glDrawElements(GL_QUADS, 4, GL_UNSIGNED_SHORT, indices);
+      glPopMatrix();
+    }
+  glFinish();
+  unsigned int matrix_msec = Timer::Poll();
+
+  // Transform kernel alone
+  SpriteBatch::Quads quads;
+  for (int i = 0; i < count; ++i)
+    quads.Add(xfs[i], co0, co1, uv0, uv1, 0xffffffff);
+  std::vector<SpriteBatch::Vertex> verts(count * 4);
+  Timer::Poll();
+  for (int pass = 0; pass < PASSES; ++pass)
+    SpriteBatch::Transform(quads, 0, count, &verts[0]);
+  unsigned int kernel_msec = Timer::Poll();
+
+  // Full batched path
+  SpriteBatch::State state;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    for (int i = 0; i < count; ++i)
+      SpriteBatch::Add(state, xfs[i], co0, co1, uv0, uv1, Color::white());
+    SpriteBatch::Flush();
+  }
+  glFinish();
+  unsigned int batch_msec = Timer::Poll();
+
+  WARN("%d sprites x %d: matrix stack %u msec, transform kernel %u msec, "
+       "batched %u msec", count, PASSES, matrix_msec, kernel_msec,
+       batch_msec);
+  Mode::Check();
+}
+
+void TextureMatrix() {
+
+  // Each step changes only one axis of the translation or scale
+  const Vec<2> steps[][2] = {
+    { Vec<2>(0, 0), Vec<2>(1, 1) },
+    { Vec<2>(0.5f, 0), Vec<2>(1, 1) },
+    { Vec<2>(0.5f, 0.25f), Vec<2>(1, 1) },
+    { Vec<2>(0.5f, 0.25f), Vec<2>(0.5f, 1) },
+    { Vec<2>(0.5f, 0.25f), Vec<2>(0.5f, 0.125f) },
+  };
+  const int count = sizeof (steps) / sizeof (steps[0]);
+  int mismatches = 0;
+  for (int i = 0; i < count; ++i) {
+    Mode::TextureMatrix(steps[i][0], steps[i][1]);
+    float matrix[16];
+    glGetFloatv(GL_TEXTURE_MATRIX, matrix);
+    if (matrix[0] != steps[i][1].x() || matrix[5] != steps[i][1].y() ||
+        matrix[12] != steps[i][0].x() || matrix[13] != steps[i][0].y())
+      ++mismatches;
+  }
+  Mode::TextureMatrix(Vec<2>(0, 0), Vec<2>(1, 1));
+
+  WARN("%d single axis texture matrix changes, %d not applied", count - 1,
+       mismatches);
+  Mode::Check();
+}
+
+void Deseam(int size) {
+  Surface sheet(size, size), per_pixel(size, size), rows(size, size);
+  RandomSheet(sheet);
+
+  // Per-pixel reference
+  unsigned int per_pixel_msec = 0;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    sheet.Blit(per_pixel, 0, 0, size, size, 0, 0);
+    Timer::Poll();
+    DeseamPerPixel(per_pixel);
+    per_pixel_msec += Timer::Poll();
+  }
+
+  // Row-based implementation
+  unsigned int rows_msec = 0;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    sheet.Blit(rows, 0, 0, size, size, 0, 0);
+    Timer::Poll();
+    rows.Deseam();
+    rows_msec += Timer::Poll();
+  }
+
+  // Both must produce the same pixels
+  int mismatches = 0;
+  for (int y = 0; y < size; ++y)
+    for (int x = 0; x < size; ++x)
+      if (!(per_pixel.Get(x, y) == rows.Get(x, y)))
+        ++mismatches;
+
+  WARN("%dx%d sheet x %d: per-pixel deseam %u msec, row deseam %u msec, "
+       "%d mismatched pixels", size, size, PASSES, per_pixel_msec,
+       rows_msec, mismatches);
+}
+
+void ParseConfig(int sprites) {
+
+  // Write a synthetic sprite config
+  std::string filename = os::UserDir();
+  filename += "/bench.cfg";
+  FILE* file = os::OpenWrite(filename.c_str());
+  if (!file)
+    return;
+  for (int i = 0; i < sprites; ++i)
+    fprintf(file, "# Sprite %d\nsprite%d {\n\tfile \"data/sprite %d.png\"\n"
+            "\tbox %d %d 32 32 # frame\n\tcenter 16 16\n\tcolor 1 1 1 %g\n"
+            "\tblend alpha\n}\n\n", i, i, i % 50, i % 8 * 32, i / 8 % 8 * 32,
+            math::UnitRand());
+  long bytes = ftell(file);
+  fclose(file);
+
+  // Character at a time reference
+  unsigned int per_char_msec = 0;
+  int per_char_tokens = 0;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    Timer::Poll();
+    if ((file = os::OpenRead(filename.c_str()))) {
+      per_char_tokens = CountConfigTokens(file);
+      fclose(file);
+    }
+    per_char_msec += Timer::Poll();
+  }
+
+  // Buffered parser builds the whole tree, with the compiled cache off
+  var::String* cache = var::Get("config.cache");
+  std::string cache_value = cache ? cache->c_str() : "";
+  if (cache)
+    *cache = "0";
+  unsigned int buffered_msec = 0;
+  int buffered_tokens = 0;
+  for (int pass = 0; pass < PASSES; ++pass) {
+    Timer::Poll();
+    ptr::Scope<Config> config(new Config(filename.c_str()));
+    buffered_msec += Timer::Poll();
+    buffered_tokens = CountConfigTokens(config->root());
+  }
+
+  // Compiled cache, written once and then mapped on every pass
+  unsigned int cached_msec = 0;
+  int cached_tokens = 0;
+  if (cache)
+    *cache = cache_value.c_str();
+  {
+    ptr::Scope<Config> config(new Config(filename.c_str()));
+  }
+  for (int pass = 0; pass < PASSES; ++pass) {
+    Timer::Poll();
+    ptr::Scope<Config> config(new Config(filename.c_str()));
+    cached_msec += Timer::Poll();
+    cached_tokens = CountConfigTokens(config->root());
+  }
+  if (os::CacheDir()) {
+    char buf[64];
+    snprintf(buf, sizeof (buf), "/%08x.cfb", str::Hash(filename.c_str()));
+    remove((os::CacheDir() + std::string(buf)).c_str());
+  }
+  remove(filename.c_str());
+
+  WARN("%ld byte config x %d: per-character tokenizer %u msec, buffered "
+       "parser %u msec, %d/%d tokens", bytes, PASSES, per_char_msec,
+       buffered_msec, per_char_tokens, buffered_tokens);
+  WARN("%ld byte config x %d: compiled cache %u msec, %d tokens", bytes,
+       PASSES, cached_msec, cached_tokens);
+}
+
+void Cull(int count) {
+  Sprite::Data data;
+  data.box_size_ = Vec<2>(32, 32);
+  std::vector<Sprite> sprites(count, Sprite(&data));
+  for (int i = 0; i < count; ++i)
+    sprites[i].set_origin(Vec<2>(math::UnitRand() * Mode::width() * 10,
+                                 math::UnitRand() * Mode::height() * 10));
+  Texture::Deselect();
+  glFinish();
+
+  // Every sprite checks whether it is on screen
+  Timer::Poll();
+  for (int pass = 0; pass < PASSES; ++pass) {
+    for (int i = 0; i < count; ++i)
+      sprites[i].Draw();
+    SpriteBatch::Flush();
+  }
+  glFinish();
+  unsigned int each_msec = Timer::Poll();
+
+  // Only sprites in the cells on screen are looked at
+  for (int i = 0; i < count; ++i)
+    sprites[i].Place();
+  unsigned int place_msec = Timer::Poll();
+  for (int pass = 0; pass < PASSES; ++pass) {
+    Sprite::DrawVisible();
+    SpriteBatch::Flush();
+  }
+  glFinish();
+  unsigned int grid_msec = Timer::Poll();
+
+  WARN("%d sprites x %d: culled one by one %u msec, level index %u msec "
+       "(placed in %u msec)", count, PASSES, each_msec, grid_msec,
+       place_msec);
+  Mode::Check();
+}
+
+} // namespace bench
+} // namespace dragoon
@@ -0,0 +1,49 @@
+/******************************************************************************\
+ Dragoon - Copyright (C) 2010 - Michael Levin
+
+ This program is free software; you can redistribute it and/or modify it under
+ the terms of the GNU General Public License as published by the Free Software
+ Foundation; either version 2, or (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful, but WITHOUT
+ ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+ FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+\******************************************************************************/
+
+#pragma once
+
+namespace dragoon {
+namespace bench {
+
+/** Run all benchmarks and print the timings as warnings, so they are shown
+    in optimized builds too. Requires the video mode to be set. */
+void Run();
+
+/** Compare the matrix-stack sprite path with the batched transform kernel
+ *  @param count  Number of sprites drawn per pass
+ */
+void Sprites(int count);
+
+/** Check that texture matrix changes along a single axis are not skipped
+    by the state cache */
+void TextureMatrix();
+
+/** Compare per-pixel surface deseaming with the row-based implementation
+ *  @param size  Width and height of the synthetic sprite sheet
+ */
+void Deseam(int size);
+
+/** Compare reading a config file one character at a time with the buffered
+    parser and with loading its compiled cache
+ *  @param sprites  Number of sprite blocks in the synthetic config
+ */
+void ParseConfig(int sprites);
+
+/** Compare culling every sprite one by one with drawing the sprites found
+    in the level index
+ *  @param count  Number of sprites scattered over a level of 10x10 screens
+ */
+void Cull(int count);
+
+} // namespace bench
+} // namespace dragoon
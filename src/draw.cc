@@ -13,6 +13,7 @@
 #include "Vec.h"
 #include "Mode.h"
 #include "Sprite.h"
+#include "SpriteBatch.h"
 
 namespace dragoon {
 namespace draw {
@@ -21,6 +22,9 @@ void rect(Vec<2> origin, float z, Vec<2> size, Color mod, Color add) {
   if (z < 0.f || (mod.a() <= 0 && add.a() <= 0))
     return;
 
+  // Batched sprites behind the rectangle must be drawn first
+  SpriteBatch::Flush();
+
   // Setup quad
   Texture::Deselect();
   Sprite::Vertex verts[4];
@@ -32,31 +36,34 @@ void rect(Vec<2> origin, float z, Vec<2> size, Color mod, Color add) {
 
   // No need for depth testing if closest possible
   if (z <= 0)
-    glDisable(GL_DEPTH_TEST);
+    Mode::Disable(GL_DEPTH_TEST);
 
   // Additive blending
   if (add.a() >= 0.f) {
     add.SelectAdd();
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-    glDisable(GL_ALPHA_TEST);
+    Mode::BlendFunc(GL_SRC_ALPHA, GL_ONE);
+    Mode::Disable(GL_ALPHA_TEST);
     glInterleavedArrays(Sprite::Vertex::FORMAT, 0, verts);
     glDrawArrays(GL_QUADS, 0, 4);
     Mode::faces$ += 2;
+    ++Mode::calls$;
   }
 
   // Alpha blending
   if (mod.a() >= 0.f) {
     mod.Select();
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    glEnable(GL_ALPHA_TEST);
+    Mode::BlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    Mode::Enable(GL_ALPHA_TEST);
+    Mode::AlphaFunc(GL_GREATER, 1 / 255.f);
     glInterleavedArrays(Sprite::Vertex::FORMAT, 0, verts);
     glDrawArrays(GL_QUADS, 0, 4);
     Mode::faces$ += 2;
+    ++Mode::calls$;
   }
 
   /* Remember to re-enable depth testing */
   if (z <= 0)
-    glEnable(GL_DEPTH_TEST);
+    Mode::Enable(GL_DEPTH_TEST);
 
   Mode::Check();
 }
@@ -21,13 +21,13 @@ namespace {
   bool debug$;
   bool color$;
 
-  // Return a bash color code
-  const char* ColorCode(int a, int b) {
-    static char buf[128];
+  // Return a bash color code, messages are logged from worker threads too
+  std::string ColorCode(int a, int b) {
     if (!color$)
       return "";
     if (a < 0 || b < 0)
       return "\033[;m";
+    char buf[32];
     snprintf(buf, sizeof(buf), "\033[%d;%dm", a, b);
     return buf;
   }
@@ -41,7 +41,7 @@ namespace {
 
     // Print color-coded program, file, function, and line identifier
     bool first = true;
-    fprintf(stderr, "%s", ColorCode(1, 30));
+    fprintf(stderr, "%s", ColorCode(1, 30).c_str());
     if (!program_name$.empty()) {
       fprintf(stderr, "%s", program_name$.c_str());
       first = false;
@@ -63,13 +63,13 @@ namespace {
         fprintf(stderr, detail$ && color$ ? " " : ": ");
       switch (level) {
       case LEVEL_ERROR:
-        fprintf(stderr, "%s", ColorCode(1, 31));
+        fprintf(stderr, "%s", ColorCode(1, 31).c_str());
         break;
       case LEVEL_WARN:
-        fprintf(stderr, "%s", ColorCode(1, 33));
+        fprintf(stderr, "%s", ColorCode(1, 33).c_str());
         break;
       default:
-        fprintf(stderr, "%s", ColorCode(-1, -1));
+        fprintf(stderr, "%s", ColorCode(-1, -1).c_str());
         break;
       }
     } else if (!first)
@@ -88,7 +88,7 @@ void set_detail(int flags) { detail$ = flags; }
 void Print(const char* file, int line, const char* func,
            Level level, const char* string) {
   if (PrintStart(file, line, func, level))
-    fprintf(stderr, "%s\n%s", string, ColorCode(-1,-1));
+    fprintf(stderr, "%s\n%s", string, ColorCode(-1, -1).c_str());
 
   // Errors are fatal
   if (level == LEVEL_ERROR)
@@ -99,7 +99,7 @@ void Printv(const char* file, int line, const char* func,
             Level level, const char* fmt, va_list va) {
   if (PrintStart(file, line, func, level)) {
     vfprintf(stderr, fmt, va);
-    fprintf(stderr, "\n%s", ColorCode(-1,-1));
+    fprintf(stderr, "\n%s", ColorCode(-1, -1).c_str());
   }
 
   /// Errors are fatal
@@ -10,10 +10,13 @@
  FOR A PARTICULAR PURPOSE. See the GNU General Public License for more details.
 \******************************************************************************/
 
+#include "bench.h"
 #include "log.h"
 #include "os.h"
 #include "ui.h"
 #include "input.h"
+#include "Camera.h"
+#include "Jobs.h"
 #include "Mode.h"
 #include "Sprite.h"
 #include "Text.h"
@@ -34,6 +37,7 @@ namespace dragoon {
 
         DEBUG("Cleaning up");
         var::SaveConfig(config_name$.c_str());
+        Jobs::Cleanup();
         SDL_Quit();
       } catch (log::Exception e) {
         e.Print();
@@ -64,6 +68,7 @@ int main(int argc, char* argv[]) {
 
     // Register variables
     var::Bool debug_prints("debug.prints");
+    var::Bool debug_bench("debug.bench");
     var::String edit_map("debug.edit");
     var::String play_map("debug.play");
 
@@ -105,6 +110,9 @@ int main(int argc, char* argv[]) {
     SDL_WM_SetCaption(PACKAGE_STRING, PACKAGE);
     SDL_ShowCursor(SDL_DISABLE);
 
+    // Start worker threads for loading
+    Jobs::Init();
+
     // Setup video mode, interface
     Mode::Set();
     ui::Init();
@@ -117,6 +125,12 @@ int main(int argc, char* argv[]) {
     // Test sprites
     Sprite::LoadConfig("data/test.cfg");
     Sprite test_sprite("test");
+    Texture::LogLoads();
+    DEBUG("Started up in %u msec", SDL_GetTicks());
+
+    // Run benchmarks
+    if (debug_bench)
+      bench::Run();
 
     // Main loop
     DEBUG("Entering main loop");
@@ -158,19 +172,36 @@ int main(int argc, char* argv[]) {
 
       // Update FPS counter
       if (CHECKED && throttled.Poll(2000)) {
-        char buf[80];
-        snprintf(buf, sizeof(buf), "%.1f fps (%.0f%% throt), %.0f faces",
+        char buf[128];
+        snprintf(buf, sizeof(buf),
+                 "%.1f fps (%.0f%% throt), %.0f faces, %.0f calls, "
+                 "%.0f/%.0f state changes, %.0f text allocs",
                  throttled.Fps(), throttled.PerFrame() * 100,
-                 Mode::faces$.PerFrame());
+                 Mode::faces$.PerFrame(), Mode::calls$.PerFrame(),
+                 Mode::state_changes$.PerFrame(),
+                 Mode::state_changes$.PerFrame() +
+                 Mode::state_skips$.PerFrame(), Text::allocs$.PerFrame());
         throttled.Reset();
         Mode::faces$.Reset();
+        Mode::calls$.Reset();
+        Mode::state_changes$.Reset();
+        Mode::state_skips$.Reset();
+        Text::allocs$.Reset();
         status.SetText(buf);
       }
 
+      // Finish loading jobs and pick up changed assets, reloaded data is
+      // only swapped in here between frames
+      Jobs::Poll();
+      Sprite::Reload();
+
       // Frame
       Mode::Begin();
-      ui::Update();
+      Camera::Begin();
+      Sprite::DrawVisible();
       test_sprite.Draw();
+      Camera::End();
+      ui::Update();
       if (CHECKED)
         status.Draw();
       Mode::End();
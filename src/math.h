@@ -25,6 +25,16 @@ static inline int NextPow2(int n) {
   return p;
 }
 
+/** Greatest common divisor of two non-negative integers */
+static inline int Gcd(int a, int b) {
+  while (b) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
 /** Limit a value to a range */
 template<typename T> void Limit(T& f, T min, T max) {
   if (f < min)
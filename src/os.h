@@ -27,6 +27,41 @@ namespace os {
       directory exists after the call. */
   bool Mkdir(const char* path);
 
+  /** Returns the path to the cache directory inside the user directory,
+      creating it if necessary. Returns \c NULL if there is none. */
+  const char* CacheDir();
+
+  /** Get the size and modification time of a file. The time is in
+      nanoseconds where the file system keeps them, so that files changed
+      twice within a second are told apart.
+   *  @returns false if the file does not exist
+   */
+  bool FileInfo(const char* path, long long& size, long long& mtime);
+
+  /** Map a file into memory for reading
+   *  @param size  Set to the size of the file
+   *  @returns Pointer to the mapped file or \c NULL on failure
+   */
+  const void* MapFile(const char* path, size_t& size);
+
+  /** Unmap a file mapped by MapFile() */
+  void UnmapFile(const void* data, size_t size);
+
+  /** Start watching a file for changes. Files replaced by renaming another
+      file over them are seen as changed too.
+   *  @returns false if files cannot be watched
+   */
+  bool Watch(const char* path);
+
+  /** Get the next watched file that has changed since the last call
+   *  @param path  Set to the path of the file, as it was passed to Watch()
+   *  @returns false if no more files have changed
+   */
+  bool Changed(std::string& path);
+
+  /** Returns the number of processor cores available */
+  int Cores();
+
   /** Set the callback function that handles Unix signals */
   void HandleSignals(void (*func)(int signal));
 
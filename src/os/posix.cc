@@ -16,6 +16,17 @@
 namespace dragoon {
 namespace os {
 
+namespace {
+
+  // Watched files and the directories they are in, keyed by watch
+  // descriptor. Directories are watched so that editors that save by
+  // renaming a new file over the old one are noticed.
+  int watch_fd = -1;
+  std::map<int, std::string> watch_dirs;
+  std::set<std::string> watch_files;
+  std::deque<std::string> changed_files;
+}
+
 bool Mkdir(const char* path) {
   if (!::mkdir(path, S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH))
     DEBUG("Created directory '%s'", path);
@@ -36,10 +47,108 @@ const char* UserDir(void) {
   return userDir;
 }
 
+const char* CacheDir() {
+  static char cacheDir[256];
+  if (cacheDir[0])
+    return cacheDir;
+  snprintf(cacheDir, sizeof(cacheDir), "%s/cache", UserDir());
+  Mkdir(cacheDir);
+  return cacheDir;
+}
+
 const char *AppDir(void) {
   return PKGDATADIR;
 }
 
+bool FileInfo(const char* path, long long& size, long long& mtime) {
+  struct stat info;
+  if (stat(path, &info))
+    return false;
+  size = info.st_size;
+#ifdef __APPLE__
+  long long nsec = info.st_mtimespec.tv_nsec;
+#else
+  long long nsec = info.st_mtim.tv_nsec;
+#endif
+  mtime = info.st_mtime * 1000000000LL + nsec;
+  return true;
+}
+
+const void* MapFile(const char* path, size_t& size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return NULL;
+  struct stat info;
+  void* data = NULL;
+  if (!fstat(fd, &info) && info.st_size > 0) {
+    size = info.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+      data = NULL;
+  }
+  close(fd);
+  return data;
+}
+
+void UnmapFile(const void* data, size_t size) {
+  if (data)
+    munmap((void*)data, size);
+}
+
+bool Watch(const char* path) {
+#ifdef __linux__
+  if (watch_fd < 0 && (watch_fd = inotify_init1(IN_NONBLOCK)) < 0) {
+    WARN("Failed to initialize inotify: %s", strerror(errno));
+    return false;
+  }
+  const char* slash = strrchr(path, '/');
+  std::string dir = slash ? std::string(path, slash - path) : ".";
+  int wd = inotify_add_watch(watch_fd, dir.c_str(),
+                             IN_CLOSE_WRITE | IN_MOVED_TO);
+  if (wd < 0) {
+    WARN("Failed to watch '%s': %s", dir.c_str(), strerror(errno));
+    return false;
+  }
+  watch_dirs[wd] = slash ? dir + "/" : "";
+  watch_files.insert(path);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool Changed(std::string& path) {
+#ifdef __linux__
+
+  // Collect changed files until there are no more events
+  char buf[4096]
+    __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  while (watch_fd >= 0 && (length = read(watch_fd, buf, sizeof (buf))) > 0)
+    for (char* p = buf; p < buf + length; ) {
+      const inotify_event* event = (const inotify_event*)p;
+      p += sizeof (inotify_event) + event->len;
+      if (!event->len)
+        continue;
+      std::string name = watch_dirs[event->wd] + event->name;
+      if (watch_files.count(name) &&
+          std::find(changed_files.begin(), changed_files.end(), name) ==
+          changed_files.end())
+        changed_files.push_back(name);
+    }
+#endif
+  if (changed_files.empty())
+    return false;
+  path = changed_files.front();
+  changed_files.pop_front();
+  return true;
+}
+
+int Cores() {
+  long cores = sysconf(_SC_NPROCESSORS_ONLN);
+  return cores > 0 ? cores : 1;
+}
+
 void HandleSignals(void (*func)(int signal)) {
 
   // Ignore certain signals
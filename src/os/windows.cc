@@ -23,10 +23,36 @@ const char* UserDir(void) {
   return NULL;
 }
 
+const char* CacheDir() {
+  return NULL;
+}
+
 const char *AppDir(void) {
   return NULL;
 }
 
+bool FileInfo(const char* path, long long& size, long long& mtime) {
+  return false;
+}
+
+const void* MapFile(const char* path, size_t& size) {
+  return NULL;
+}
+
+void UnmapFile(const void* data, size_t size) {}
+
+bool Watch(const char* path) {
+  return false;
+}
+
+bool Changed(std::string& path) {
+  return false;
+}
+
+int Cores() {
+  return 1;
+}
+
 void HandleSignals(void (*func)(int signal)) {}
 
 } // namespace dragoon
@@ -93,6 +93,9 @@ public:
 
   /** Assignment from raw pointer type does not free current pointer */
   void operator=(T* ptr) { ptr_ = ptr; }
+
+  /** Exchange owned pointers with another scope pointer */
+  void Swap(Scope& other) { std::swap(ptr_, other.ptr_); }
 };
 
 } // namespace ptr
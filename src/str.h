@@ -29,5 +29,71 @@ namespace str {
     return false;
   }
 
+  /** Returns a 32-bit FNV-1a hash of a string */
+  static inline unsigned int Hash(const char* s) {
+    unsigned int hash = 2166136261u;
+    for (; *s; ++s)
+      hash = (hash ^ (unsigned char)*s) * 16777619u;
+    return hash;
+  }
+
+  /** Returns a 32-bit FNV-1a hash of a string with its letters lowercased */
+  static inline unsigned int HashLower(const char* s) {
+    unsigned int hash = 2166136261u;
+    for (; *s; ++s)
+      hash = (hash ^ (unsigned char)tolower((unsigned char)*s)) * 16777619u;
+    return hash;
+  }
+
+  /** Decode one UTF-8 character and advance past it. Malformed bytes are
+      skipped one at a time and decode to the replacement character. */
+  static inline unsigned int DecodeUTF8(const char*& s) {
+    const unsigned char* p = (const unsigned char*)s;
+    int length = p[0] < 0x80 ? 1 : p[0] < 0xc2 ? 0 : p[0] < 0xe0 ? 2 :
+                 p[0] < 0xf0 ? 3 : p[0] < 0xf5 ? 4 : 0;
+    unsigned int ch = length == 1 ? p[0] : p[0] & (0x7f >> length);
+    for (int i = 1; i < length; ++i) {
+      if ((p[i] & 0xc0) != 0x80) {
+        length = 0;
+        break;
+      }
+      ch = (ch << 6) | (p[i] & 0x3f);
+    }
+    if (!length) {
+      ++s;
+      return 0xfffd;
+    }
+    s += length;
+    return ch;
+  }
+
+  /** Encode a character as UTF-8
+   *  @param buf  Receives at most four bytes and a terminating zero
+   *  @returns Number of bytes written, not counting the zero
+   */
+  static inline int EncodeUTF8(unsigned int ch, char* buf) {
+    int length = ch < 0x80 ? 1 : ch < 0x800 ? 2 : ch < 0x10000 ? 3 : 4;
+    if (length == 1)
+      buf[0] = (char)ch;
+    else {
+      for (int i = length - 1; i > 0; --i, ch >>= 6)
+        buf[i] = (char)(0x80 | (ch & 0x3f));
+      buf[0] = (char)((0xf00 >> length) | ch);
+    }
+    buf[length] = 0;
+    return length;
+  }
+
+  /** Returns a 32-bit FNV-1a hash of a block of memory
+   *  @param hash  Hash of the preceding data to continue from
+   */
+  static inline unsigned int Hash(const void* data, size_t size,
+                                  unsigned int hash = 2166136261u) {
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < size; ++i)
+      hash = (hash ^ p[i]) * 16777619u;
+    return hash;
+  }
+
 } // namespace dragoon
 } // namespace str
@@ -22,6 +22,7 @@ namespace ui {
 namespace {
   var::String font_name$("ui.font_name", "data/ui/font/blemished.ttf");
   var::Int font_size$("ui.font_size", 8);
+  var::Bool font_distance$("ui.font_distance", false);
   var::Int menu_height$("ui.menu_height", 128);
   var::Float bg_fade_rate$("ui.bg_fade_rate", 2);
   Menu main_menu$(160);
@@ -42,7 +43,8 @@ void Init() {
   if (str::EndsWith(font_name$.c_str(), ".png", true))
     def_font = new Text::Font(Texture::Load(font_name$.c_str()), ' ', 16, 6);
   else
-    def_font = new Text::Font(font_name$.c_str(), font_size$);
+    def_font = new Text::Font(font_name$.c_str(), font_size$, 1,
+                              font_distance$);
   Text::set_default_font(def_font);
 
   // Main menu
@@ -12,6 +12,7 @@
 
 #include "../math.h"
 #include "../var.h"
+#include "../SpriteBatch.h"
 #include "Menu.h"
 
 namespace dragoon {
@@ -141,13 +142,10 @@ void Menu::Update() {
       Scroll();
 
     // Render the menu
-    glMatrixMode(GL_MODELVIEW);
-    glPushMatrix();
-    glTranslatef(origin_.x(), origin_.y() - size_.y() / 2, 0);
+    SpriteBatch::PushOffset(Vec<2>(origin_.x(), origin_.y() - size_.y() / 2));
     for (int i = 0; i < (int)entries_.size(); ++i)
       entries_[i]->Update(fade_, size_.x(), explode, selected_ == i);
-    glPopMatrix();
-    Mode::Check();
+    SpriteBatch::PopOffset();
   }
 }
 